@@ -1,9 +1,160 @@
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
 #include "newctap.h"
 
+static volatile long bench_sink;
+
+static void bench_short(void *ctx)
+{
+    long i, sum = 0;
+    for (i = 0; i < 1000; i++) sum += i;
+    bench_sink = sum;
+}
+
+static void bench_long(void *ctx)
+{
+    long i, sum = 0;
+    for (i = 0; i < 4000; i++) sum += i;
+    bench_sink = sum;
+}
+
+static int cond_true(void *ctx)
+{
+    return 1;
+}
+
+static int cond_false(void *ctx)
+{
+    return 0;
+}
+
+static void stress_pass(void *ctx, uint thread)
+{
+    ok(1, "thread %u", thread);
+}
+
+static void stress_fail(void *ctx, uint thread)
+{
+    is_int(thread, 0, "thread %u", thread);
+}
+
+static void write_temp_file(char *path, const void *buf, size_t size)
+{
+    int fd;
+
+    if ((fd = mkstemp(path)) < 0 || write(fd, buf, size) != (ssize_t)size || close(fd) < 0)
+        bail("Failed to write a temporary file\n");
+}
+
+static void subtest_io_budget(void)
+{
+    int fd[2];
+
+    if (pipe(fd) < 0 || write(fd[1], "x", 1) != 1)
+        bail("Failed to write to a pipe\n");
+
+    is_write_calls_at_most(1);
+    is_write_calls_at_most(1, "is_write_calls_at_most with comment(%d)", 1);
+    is_write_calls_at_most(0);
+    is_write_calls_at_most(0, "is_write_calls_at_most with comment(%d)", 0);
+    is_bytes_written_at_most(1);
+    is_bytes_written_at_most(1, "is_bytes_written_at_most with comment(%d)", 1);
+    is_bytes_written_at_most(0);
+    is_bytes_written_at_most(0, "is_bytes_written_at_most with comment(%d)", 0);
+
+    close(fd[0]);
+    close(fd[1]);
+}
+
+static void subtest_pass(void)
+{
+    ok(1, "not crashed");
+}
+
+static void subtest_crash(void)
+{
+    ok(1, "before crash");
+    raise(SIGFPE);
+    ok(1, "never reached");
+}
+
+static void subtest_arena(void)
+{
+    char *small = ctap_alloc(3);
+    unsigned char *big = ctap_calloc_aligned(1, 100, 1 << 20);
+
+    is_int((uintptr_t)small % 16, 0);
+    is_int((uintptr_t)small % 16, 0, "ctap_alloc with comment(aligned by %d)", 16);
+    is_int((uintptr_t)big % (1 << 20), 0);
+    is_int((uintptr_t)big % (1 << 20), 0, "ctap_calloc_aligned with comment(aligned by %d)", 1 << 20);
+    is_int(big[99], 0);
+    is_int(big[99], 0, "ctap_calloc_aligned with comment(%s)", "zeroed");
+    is_int((uintptr_t)(big + 1) % (1 << 20), 0);
+    is_int((uintptr_t)(big + 1) % (1 << 20), 0, "ctap_calloc_aligned with comment(%s)", "big + 1");
+}
+
+static void subtest_isa_pass(void)
+{
+    ok(ctap_forced_isa != CTAP_ISA_NONE);
+    ok(ctap_forced_isa != CTAP_ISA_NONE, "subtest_each_isa with comment(%s)", ctap_isa_names[ctap_forced_isa]);
+}
+
+static void subtest_isa_fail(void)
+{
+    is_int(ctap_forced_isa, CTAP_ISA_SCALAR);
+    is_int(ctap_forced_isa, CTAP_ISA_SCALAR, "subtest_each_isa with comment(%s)", ctap_isa_names[ctap_forced_isa]);
+}
+
+static void subtest_flaky(void)
+{
+    static int runs;
+
+    ok(++runs % 3 != 0);
+    ok(runs % 3 != 0, "subtest_repeat with comment(run %d)", runs);
+}
+
+static void subtest_guarded(void)
+{
+    char *over = ctap_guarded_alloc(100, 1);
+    char *under = ctap_guarded_alloc_under(100, 16);
+
+    memset(over, 'a', 100);
+    memset(under, 'b', 100);
+    is_char(over[99], 'a');
+    is_char(over[99], 'a', "ctap_guarded_alloc with comment(%s)", "in bounds");
+    is_char(under[0], 'b');
+    is_char(under[0], 'b', "ctap_guarded_alloc_under with comment(%s)", "in bounds");
+
+    ctap_guarded_free(over);
+    ctap_guarded_free(under);
+}
+
+static void subtest_guarded_overflow(void)
+{
+    volatile char *over = ctap_guarded_alloc(100, 1);
+
+    over[100] = 'a';
+}
+
 int main(void)
 {
     int testbuf[10] = { 100 };
     int invalidbuf[10] = { 200 };
+    int readyfd[2], idlefd[2];
+    unsigned char hashbuf[100];
+    size_t chunks[] = { 1, 7, 30, 33, 29 }, off, i;
+    ctap_hash_t hash;
+    char golden[] = "/tmp/ctap-golden-XXXXXX";
+    char samefile[] = "/tmp/ctap-same-XXXXXX";
+    char difffile[] = "/tmp/ctap-diff-XXXXXX";
+
+    /* Measure I/O for is_*_at_most() */
+    setenv("CTAP_IO_BUDGET", "1", 1);
+
+    /* Recover from crashes of subtests */
+    setenv("CTAP_CATCH_SIGNALS", "1", 1);
 
     plan(-1);
 
@@ -65,7 +216,79 @@ int main(void)
     isnt_mem(testbuf, testbuf, sizeof(testbuf),  "isnt_mem with comment(%s <=> %s)", "testbuf", "testbuf");
     isnt_mem(testbuf, invalidbuf,  sizeof(testbuf));
     isnt_mem(testbuf, invalidbuf, sizeof(testbuf), "isnt_mem with comment(%s <=> %s)", "testbuf", "invalidbuf");
-    
+
+    is_hash("foo", 3, "xxh64:33bf00a859c4ba3f");
+    is_hash("foo", 3, "xxh64:33bf00a859c4ba3f", "is_hash with comment(%s <=> %s)", "foo", "xxh64:33bf00a859c4ba3f");
+    is_hash("bar", 3, "xxh64:33bf00a859c4ba3f");
+    is_hash("bar", 3, "xxh64:33bf00a859c4ba3f", "is_hash with comment(%s <=> %s)", "bar", "xxh64:33bf00a859c4ba3f");
+    isnt_hash("foo", 3, "xxh64:33bf00a859c4ba3f");
+    isnt_hash("foo", 3, "xxh64:33bf00a859c4ba3f", "isnt_hash with comment(%s <=> %s)", "foo", "xxh64:33bf00a859c4ba3f");
+    isnt_hash("bar", 3, "xxh64:33bf00a859c4ba3f");
+    isnt_hash("bar", 3, "xxh64:33bf00a859c4ba3f", "isnt_hash with comment(%s <=> %s)", "bar", "xxh64:33bf00a859c4ba3f");
+
+    /* Feed more than a stripe of 32 bytes in uneven chunks */
+    for (i = 0; i < sizeof(hashbuf); i++)
+        hashbuf[i] = i;
+    ctap_hash_init(&hash);
+    for (i = 0, off = 0; i < sizeof(chunks) / sizeof(chunks[0]); off += chunks[i++])
+        ctap_hash_update(&hash, hashbuf + off, chunks[i]);
+    is_hash(hashbuf, sizeof(hashbuf), "xxh64:6ac1e58032166597");
+    is_hash_final(&hash, "xxh64:6ac1e58032166597");
+    is_hash_final(&hash, "xxh64:6ac1e58032166597", "is_hash_final with comment(%s <=> %s)", "hashbuf", "xxh64:6ac1e58032166597");
+    is_hash_final(&hash, "xxh64:33bf00a859c4ba3f");
+    is_hash_final(&hash, "xxh64:33bf00a859c4ba3f", "is_hash_final with comment(%s <=> %s)", "hashbuf", "xxh64:33bf00a859c4ba3f");
+
+    write_temp_file(golden, testbuf, sizeof(testbuf));
+    write_temp_file(samefile, testbuf, sizeof(testbuf));
+    write_temp_file(difffile, invalidbuf, sizeof(invalidbuf));
+    is_file_content(testbuf, sizeof(testbuf), golden);
+    is_file_content(testbuf, sizeof(testbuf), golden, "is_file_content with comment(%s <=> %s)", "testbuf", "golden");
+    is_file_content(invalidbuf, sizeof(invalidbuf), golden);
+    is_file_content(invalidbuf, sizeof(invalidbuf), golden, "is_file_content with comment(%s <=> %s)", "invalidbuf", "golden");
+    is_file_eq(samefile, golden);
+    is_file_eq(samefile, golden, "is_file_eq with comment(%s <=> %s)", "samefile", "golden");
+    is_file_eq(difffile, golden);
+    is_file_eq(difffile, golden, "is_file_eq with comment(%s <=> %s)", "difffile", "golden");
+    unlink(golden);
+    unlink(samefile);
+    unlink(difffile);
+
+    is_faster(bench_short, bench_long, NULL, 2.0);
+    is_faster(bench_short, bench_long, NULL, 2.0, "is_faster with comment(%s <=> %s)", "short", "long");
+    is_faster(bench_long, bench_short, NULL, 1.0);
+    is_faster(bench_long, bench_short, NULL, 1.0, "is_faster with comment(%s <=> %s)", "long", "short");
+
+    eventually(cond_true, NULL, 100);
+    eventually(cond_true, NULL, 100, "eventually with comment(%s)", "true");
+    eventually(cond_false, NULL, 10);
+    eventually(cond_false, NULL, 10, "eventually with comment(%s)", "false");
+
+    if (pipe(readyfd) < 0 || pipe(idlefd) < 0 || write(readyfd[1], "x", 1) != 1)
+        bail("Failed to prepare pipes\n");
+    eventually_fd(readyfd[0], POLLIN, 100);
+    eventually_fd(readyfd[0], POLLIN, 100, "eventually_fd with comment(%s)", "readable");
+    eventually_fd(idlefd[0], POLLIN, 10);
+    eventually_fd(idlefd[0], POLLIN, 10, "eventually_fd with comment(%s)", "idle");
+
+    stress("stress with passing threads", stress_pass, NULL, 4, 1000);
+    stress("stress with failing threads", stress_fail, NULL, 4, 1000);
+
+    subtest("I/O budgets", subtest_io_budget);
+
+
+    subtest("subtest without crash", subtest_pass);
+    subtest("subtest with crash", subtest_crash);
+
+    subtest("ctap_alloc and ctap_calloc_aligned", subtest_arena);
+
+    subtest_each_isa("subtest_each_isa with passing levels", subtest_isa_pass);
+    subtest_each_isa("subtest_each_isa with failing levels", subtest_isa_fail);
+
+    subtest_repeat("subtest_repeat with passing runs", subtest_pass, 3);
+    subtest_repeat("subtest_repeat with a flaky run", subtest_flaky, 3);
+
+    subtest("ctap_guarded_alloc in bounds", subtest_guarded);
+    subtest("ctap_guarded_alloc with overflow", subtest_guarded_overflow);
 
     done_testing(-1);
 
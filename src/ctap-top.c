@@ -0,0 +1,110 @@
+/*
+ * ctap-top - watch the live progress of a ctap test.
+ *
+ *     $ CTAP_STATUS_FILE=/tmp/soak.status ./soak_test &
+ *     $ ctap-top /tmp/soak.status
+ */
+#include <stdio.h>    /* printf(3)               */
+#include <stdlib.h>   /* exit(3)                 */
+#include <string.h>   /* memcpy(3)               */
+#include <time.h>     /* clock_gettime(2)        */
+#include <errno.h>    /* errno                   */
+#include <fcntl.h>    /* open(2)                 */
+#include <unistd.h>   /* getopt(3), usleep(3)    */
+#include <signal.h>   /* kill(2)                 */
+#include <sys/mman.h> /* mmap(2)                 */
+#include "newctap.h"
+
+#define STALL_SEC 10
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void usage(void)
+{
+    fputs("Usage: ctap-top [-i interval_ms] status_file\n", stderr);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const struct ctap_status *st;
+    struct ctap_status snap;
+    uint interval_ms = 1000;
+    uint64_t seq, last_assertions = 0;
+    double now, last_ns = 0, elapsed, idle;
+    int opt, fd;
+    uint i;
+
+    while ((opt = getopt(argc, argv, "i:")) != -1) {
+        switch (opt) {
+        case 'i': interval_ms = atoi(optarg); break;
+        default:  usage();
+        }
+    }
+    if (optind + 1 != argc || interval_ms == 0)
+        usage();
+
+    if ((fd = open(argv[optind], O_RDONLY)) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    st = mmap(NULL, sizeof(*st), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (st == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (__atomic_load_n(&st->magic, __ATOMIC_ACQUIRE) != CTAP_STATUS_MAGIC ||
+        st->version != CTAP_STATUS_VERSION) {
+        fprintf(stderr, "%s: not a ctap status file\n", argv[optind]);
+        return 1;
+    }
+
+    for (;;) {
+        /* Retry while the test is updating names */
+        do {
+            seq = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE);
+            memcpy(&snap, st, sizeof(snap));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((seq & 1) || seq != __atomic_load_n(&st->seq, __ATOMIC_RELAXED));
+
+        now     = now_ns();
+        elapsed = (now - snap.start_ns) / 1e9;
+        idle    = snap.update_ns ? (now - snap.update_ns) / 1e9 : elapsed;
+
+        printf("\033[H\033[J");
+        printf("pid %llu  elapsed %.0fs  assertions %llu\n",
+               (unsigned long long)snap.pid, elapsed, (unsigned long long)snap.assertions);
+        printf("rate %.0f/s (average %.0f/s)  last assertion %.1fs ago%s\n\n",
+               last_ns ? (snap.assertions - last_assertions) / ((now - last_ns) / 1e9) : 0.0,
+               elapsed > 0 ? snap.assertions / elapsed : 0.0, idle,
+               (idle >= STALL_SEC && !snap.finished) ? "  ** STALLED? **" : "");
+        printf("%5s %8s %8s %8s  %s\n", "depth", "run", "pass", "fail", "subtest");
+        for (i = 0; i <= snap.depth && i < CTAP_STATUS_DEPTH; i++) {
+            printf("%5u %8llu %8llu %8llu  %s\n", i,
+                   (unsigned long long)snap.tests[i].run,
+                   (unsigned long long)snap.tests[i].pass,
+                   (unsigned long long)snap.tests[i].fail,
+                   i ? snap.tests[i].name : "(main)");
+        }
+        fflush(stdout);
+
+        if (snap.finished) {
+            puts("\nfinished");
+            return 0;
+        }
+        if (kill(snap.pid, 0) < 0 && errno == ESRCH) {
+            puts("\nexited without done_testing()");
+            return 1;
+        }
+
+        last_assertions = snap.assertions;
+        last_ns         = now;
+        usleep(interval_ms * 1000);
+    }
+}
@@ -1,13 +1,27 @@
+/**
+ * Include this header wherever you write tests. Exactly one translation unit of the program
+ * must define CTAP_IMPLEMENTATION before including it, or link libctap.a (or libctap.so) instead,
+ * so that the test state is defined once and shared by all of them.
+ * Configuration macros like SUBTEST_MAX_DEPTH take effect in that translation unit.
+ * The implementation needs _GNU_SOURCE, which this header defines but which only takes effect
+ * before the first system header, so define CTAP_IMPLEMENTATION (or _GNU_SOURCE) before any of them:
+ *
+ *     #define CTAP_IMPLEMENTATION
+ *     #include "newctap.h"
+ *     #include <stdio.h>
+ */
+#if defined(CTAP_IMPLEMENTATION) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE           /* pthread_attr_setaffinity_np(3) */
+#endif
+
 #ifndef _CTAP_H_
 #define _CTAP_H_
 
-#include <stdio.h>   /* fdopen(3)              */
-#include <stdlib.h>  /* exit(3)                */
-#include <string.h>  /* strlen(3)              */
-#include <stdarg.h>  /* va_start(3), va_end(3) */
-#include <float.h>   /* DBL_EPSILON            */
-#include <math.h>    /* fabs(3)                */
-#include <assert.h>  /* assert(3)              */
+#include <stdio.h>    /* fdopen(3)               */
+#include <stdarg.h>   /* va_start(3), va_end(3)  */
+#include <stddef.h>   /* size_t                  */
+#include <stdint.h>   /* uint64_t                */
+#include <poll.h>     /* POLLIN                  */
 
 #ifndef SUBTEST_MAX_DEPTH
 #define SUBTEST_MAX_DEPTH 10
@@ -15,41 +29,131 @@
 
 #define INDENT_LEVEL      4
 
-typedef unsigned int uint;
+#ifndef CTAP_BACKTRACE_DEPTH
+#define CTAP_BACKTRACE_DEPTH   32
+#endif
 
-enum bool_mode { COND_TRUE, COND_FALSE };
+#ifndef CTAP_ALTSTACK_SIZE
+#define CTAP_ALTSTACK_SIZE     (64 * 1024)
+#endif
 
-static struct {
-    int  plan;
-    uint run;
-    uint pass;
-    uint fail;
-} tests[SUBTEST_MAX_DEPTH];
+#ifndef CTAP_ARENA_CHUNK
+#define CTAP_ARENA_CHUNK       (2 << 20)
+#endif
 
-static uint current;
+#define CTAP_ARENA_ALIGN       16
+#define CTAP_HUGEPAGE_SIZE     (2 << 20)
 
-#define TESTS_PLAN tests[current].plan
-#define TESTS_RUN  tests[current].run
-#define TESTS_PASS tests[current].pass
-#define TESTS_FAIL tests[current].fail
+#ifndef CTAP_GUARD_POOL_MAX
+#define CTAP_GUARD_POOL_MAX    64
+#endif
 
-static FILE *tapout;
-static FILE *msgout;
+#define CTAP_STATUS_MAGIC      0x5441545350415443ULL /* "CTAPSTAT" */
+#define CTAP_STATUS_VERSION    1
+#define CTAP_STATUS_DEPTH      16
+#define CTAP_STATUS_NAME_MAX   64
 
-#define FL __FILE__, __LINE__
+#ifndef CTAP_REPEAT_MAX
+#define CTAP_REPEAT_MAX        256
+#endif
 
-/* Used to handy output 'got - expected' pair in _is_* functions */
-#define GOT(got, fmt, ...)      diag("    %s: " fmt "\n", got, ##__VA_ARGS__)
-#define EXP(expected, fmt, ...) diag("    %s: " fmt "\n", (bmode == COND_FALSE) ? "anything else" : expected, ##__VA_ARGS__)
+#ifndef CTAP_FILE_CHUNK
+#define CTAP_FILE_CHUNK        (1 << 20)
+#endif
+
+#ifndef CTAP_EVENTUALLY_SPINS
+#define CTAP_EVENTUALLY_SPINS  64
+#endif
 
+#ifndef CTAP_EVENTUALLY_MAX_BACKOFF_NSEC
+#define CTAP_EVENTUALLY_MAX_BACKOFF_NSEC 1000000
+#endif
+
+#ifndef CTAP_BENCH_SAMPLES
+#define CTAP_BENCH_SAMPLES     25
+#endif
+
+#ifndef CTAP_BENCH_SAMPLE_NSEC
+#define CTAP_BENCH_SAMPLE_NSEC 1000000
+#endif
+
+#ifndef CTAP_BENCH_ALPHA
+#define CTAP_BENCH_ALPHA       0.05
+#endif
+
+typedef unsigned int uint;
+
+enum bool_mode { COND_TRUE, COND_FALSE };
 
 /**
- * Print a whitespace to make indent.
+ * Status block published to the file named by CTAP_STATUS_FILE, for ctap-top to watch the test live.
+ * It is written by the test process only; counters are updated with atomic stores,
+ * and names are guarded by seq which is odd while they are being updated.
  */
-static inline void pindent(FILE *out)
-{
-    fprintf(out, "%*s", INDENT_LEVEL*current, "");
-}
+struct ctap_status {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t pid;
+    uint64_t start_ns;
+    uint64_t update_ns;
+    uint64_t assertions;
+    uint64_t finished;
+    uint64_t depth;
+    uint64_t seq;
+    struct {
+        uint64_t run;
+        uint64_t pass;
+        uint64_t fail;
+        char     name[CTAP_STATUS_NAME_MAX];
+    } tests[CTAP_STATUS_DEPTH];
+};
+
+/* SIMD dispatch levels which subtest_each_isa() runs a subtest with */
+enum ctap_isa {
+    CTAP_ISA_NONE = -1,
+    CTAP_ISA_SCALAR,
+    CTAP_ISA_SSE42,
+    CTAP_ISA_AVX2,
+    CTAP_ISA_AVX512,
+    CTAP_ISA_MAX
+};
+
+/**
+ * The ISA level forced by subtest_each_isa(), or CTAP_ISA_NONE outside of it.
+ * Runtime dispatchers of the code under test should pick the kernel of this level if set.
+ *
+ *     if (ctap_forced_isa == CTAP_ISA_SCALAR) return sum_scalar;
+ */
+extern enum ctap_isa ctap_forced_isa;
+
+/* Names of enum ctap_isa, e.g. "avx2" */
+extern const char *const ctap_isa_names[CTAP_ISA_MAX];
+
+/**
+ * A state of streaming content hash. The algorithm is XXH64 with seed 0,
+ * so expected values can be computed by `xxhsum -H1` as well.
+ *
+ *     ctap_hash_t hash;
+ *     ctap_hash_init(&hash);
+ *     ctap_hash_update(&hash, buf, size);
+ *     is_hash_final(&hash, "xxh64:ef46db3751d8e999");
+ */
+typedef struct {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char mem[32];
+    uint     memsize;
+} ctap_hash_t;
+
+enum ctap_io_kind {
+    CTAP_IO_RW_CALLS,
+    CTAP_IO_READ_CALLS,
+    CTAP_IO_WRITE_CALLS,
+    CTAP_IO_BYTES_READ,
+    CTAP_IO_BYTES_WRITTEN
+};
+
+#define FL __FILE__, __LINE__
 
 /**
  * Bail out from the test.
@@ -58,14 +162,7 @@ static inline void pindent(FILE *out)
  *
  * @param why a reason of aborting test.
  */
-void bail(char *why, ...)
-{
-    va_list ap;
-    va_start(ap, why);
-    vfprintf(msgout, why, ap);
-    va_end(ap);
-    exit(255);
-}
+void bail(char *why, ...);
 
 /**
  * Print a diagnostic message to message output.
@@ -74,13 +171,7 @@ void bail(char *why, ...)
  *
  * @param msg a format string of diagnostics
 */
-void diag(const char *msg, ...)
-{
-    va_list ap;
-    va_start(ap, msg);
-    vfprintf(msgout, msg, ap);
-    va_end(ap);
-}
+void diag(const char *msg, ...);
 
 /**
  * Initialize test with informing number of tests that you are planning going to run.
@@ -90,28 +181,13 @@ void diag(const char *msg, ...)
  *     plan(number_of_tests);
  *     plan(-1);              // You don't know how many tests will run.
  *
+ * Set the environment variable CTAP_STATUS_FILE to a path to publish live progress of the test
+ * to the memory-mapped file, which can be watched by ctap-top without touching the output streams.
+ *
  * @see done_testing()
  * @param number_of_tests a number of tests that you are planning going to run.
  */
-void plan(int ntests)
-{
-    /* Initialize output stream for TAP output and messages output */
-    if (tapout == NULL || msgout == NULL) {
-        /* TAP messages are should be writen to stdout */
-        if ((tapout = fdopen(fileno(stdout), "w")) == NULL)
-            bail("Failed to fdopen stdout: ");
-        if (setvbuf(tapout, NULL, _IONBF, 0) != 0)
-            bail("Failed to setvbuf to TAP output: ");
-        /* Comments are should be writen to stderr */
-        if ((msgout = fdopen(fileno(stderr), "w")) == NULL)
-            bail("Failed to fdopen stderr: ");
-        if (setvbuf(msgout, NULL, _IONBF, 0) != 0)
-            bail("Failed to setvbuf to Message output: ");
-    }
-
-    TESTS_PLAN = ntests;
-    TESTS_RUN = TESTS_PASS = TESTS_FAIL = 0;
-}
+void plan(int ntests);
 
 /**
  * If you were passed -1 for plan(), you must call this function at end of the test.
@@ -122,87 +198,7 @@ void plan(int ntests)
  * @see plan()
  * @param number_of_tests a number of tests that you are planning going to run.
  */
-void done_testing(int ntests)
-{
-    if (ntests < 0) {
-        TESTS_PLAN = TESTS_RUN;
-    }
-
-    pindent(tapout);
-    fprintf(tapout, "1..%d\n", TESTS_RUN);
-    if (TESTS_RUN != TESTS_PLAN) {
-        pindent(msgout);
-        fprintf(msgout, "# Looks like you planned %u tests but run %u\n", TESTS_PLAN, TESTS_RUN);
-    }
-    if (TESTS_FAIL) {
-        pindent(msgout);
-        fprintf(msgout, "# Looks like you failed %u test of %u\n", TESTS_FAIL, TESTS_RUN);
-    }
-}
-
-
-/**
- * A very core function of testing framework. This function is internally use only.
- * Check the result of test, increment the test counters.
- * Then output TAP messages and messages for users.
- * Call done_testing() if the number of tests ran is equals to the number of tests planned
- *
- * @see done_testing()
- * @param test  a result of test. 0 for fail, other for pass.
- * @param bmode a boolean mode for test result. If it is set to COND_FALSE, test result will reversed on evaluation.
- * @param file  a filename of this test has been ran.
- * @param line  a line number of the file where this test has been ran.
- * @param name  a short description of test.
- * @param ap    a argument that should pass to vfprintf(3) with name
- */
-int __ok(uint test, enum bool_mode bmode,
-         const char *file, uint line, const char *name, va_list ap)
-{
-    va_list ap_copy;
-    uint namelen = strlen(name);
-    va_copy(ap_copy, ap);
-
-    TESTS_RUN++;
-    pindent(tapout);
-
-    if (bmode == COND_FALSE) test = !test;
-
-    if (!test) fputs("not ", tapout);
-
-    fprintf(tapout, "ok %d", TESTS_RUN);
-
-    /* Print tests name if specified */
-    if (namelen) {
-        fputs(" - ", tapout);
-        vfprintf(tapout, name, ap);
-    }
-    fputc('\n', tapout);
-
-    if (test) {
-        TESTS_PASS++;
-    } else {
-        TESTS_FAIL++;
-
-        /* Expecing output example:
-         * #   Failed test at test.c line 10.
-         * #   Failed test "MyTest" at test.c line 10.
-         */
-
-        pindent(msgout);
-        fputs("#   Failed test", msgout);
-        if (namelen) {
-            fputs(" \"", msgout);
-            vfprintf(msgout, name, ap_copy);
-            fputc('"', msgout);
-        }
-        fprintf(msgout, " at %s line %u\n", file, line);
-    }
-
-    if (TESTS_RUN == TESTS_PLAN)
-        done_testing(TESTS_PLAN);
-
-    return test;
-}
+void done_testing(int ntests);
 
 /**
  * Inform a test has been passed.
@@ -213,16 +209,7 @@ int __ok(uint test, enum bool_mode bmode,
  * @param testname a short description of test.
  */
 #define pass(...) _pass(FL, ""__VA_ARGS__)
-
-int _pass(const char *file, uint line, const char *name, ...)
-{
-    va_list ap;
-    va_start(ap, name);
-    __ok(1, COND_TRUE, file, line, name, ap);
-    va_end(ap);
-
-    return 1;
-}    
+int _pass(const char *file, uint line, const char *name, ...);
 
 /**
  * Inform a test has been failed.
@@ -233,16 +220,7 @@ int _pass(const char *file, uint line, const char *name, ...)
  * @param testname a short description of test.
  */
 #define fail(...) _fail(FL, ""__VA_ARGS__)
-
-int _fail(const char *file, uint line, const char *name, ...)
-{
-    va_list ap;
-    va_start(ap, name);
-    __ok(0, COND_TRUE, file, line, name, ap);
-    va_end(ap);
-
-    return 0;
-}    
+int _fail(const char *file, uint line, const char *name, ...);
 
 /**
  * Inform a result of some test.
@@ -255,19 +233,10 @@ int _fail(const char *file, uint line, const char *name, ...)
  * @param name a short description of test.
  */
 #define ok(test, ...) _ok(test, COND_TRUE, FL, ""__VA_ARGS__)
-
 int _ok(uint test, enum bool_mode bmode,
-        const char *file, uint line, const char *name, ...)
-{
-    va_list ap;
-    uint result;
-    va_start(ap, name);
-
-    result = __ok(test, bmode, file, line, name, ap);
-
-    va_end(ap);
-    return result;
-}
+        const char *file, uint line, const char *name, ...);
+int __ok(uint test, enum bool_mode bmode,
+         const char *file, uint line, const char *name, va_list ap);
 
 /**
  * Handy test function to compare that integer values are same.
@@ -292,22 +261,8 @@ int _ok(uint test, enum bool_mode bmode,
  * @param name     a short description of test.
  */
 #define isnt_int(got, expected, ...) _is_int(got, expected, COND_FALSE, FL, ""__VA_ARGS__)
-
 int _is_int(long got, long expected, enum bool_mode bmode,
-            const char *file, uint line, const char *name, ...)
-{
-    va_list ap;
-    uint result;
-    va_start(ap, name);
-
-    if (!(result = __ok((got == expected), bmode, file, line, name, ap))) {
-        GOT("     got", "%ld", got);
-        EXP("expected", "%ld", expected);
-    }
-
-    va_end(ap);
-    return result;
-}
+            const char *file, uint line, const char *name, ...);
 
 /**
  * Handy test function to compare that float values are same.
@@ -332,22 +287,8 @@ int _is_int(long got, long expected, enum bool_mode bmode,
  * @param name     a short description of test.
  */
 #define isnt_double(got, expected, ...) _is_double(got, expected, COND_FALSE, FL, ""__VA_ARGS__)
-
 int _is_double(double got, double expected, enum bool_mode bmode,
-               const char *file, uint line, const char *name, ...)
-{
-    va_list ap;
-    uint result;
-    va_start(ap, name);
-
-    if (!(result = __ok((fabs(got - expected) < DBL_EPSILON), bmode, file, line, name, ap))) {
-        GOT("     got", "%g", got);
-        EXP("expected", "%g", expected);
-    }
-
-    va_end(ap);
-    return result;
-}
+               const char *file, uint line, const char *name, ...);
 
 /**
  * Handy test function to compare that character values are same.
@@ -372,22 +313,8 @@ int _is_double(double got, double expected, enum bool_mode bmode,
  * @param name     a short description of test.
  */
 #define isnt_char(got, expected, ...) _is_char(got, expected, COND_FALSE, FL, ""__VA_ARGS__)
-
 int _is_char(char got, char expected, enum bool_mode bmode,
-             const char *file, uint line, const char *name, ...)
-{
-    va_list ap;
-    uint result;
-    va_start(ap, name);
-
-    if (!(result = __ok((got == expected), bmode, file, line, name, ap))) {
-        GOT("     got", "%c", got);
-        EXP("expected", "%c", expected);
-    }
-
-    va_end(ap);
-    return result;
-}
+             const char *file, uint line, const char *name, ...);
 
 /**
  * Handy test function to compare that string values are same.
@@ -416,22 +343,8 @@ int _is_char(char got, char expected, enum bool_mode bmode,
  * @param name     a short description of test.
  */
 #define isnt_str(got, expected, ...) _is_str(got, expected, COND_FALSE, FL, ""__VA_ARGS__)
-
 int _is_str(const char *got, const char *expected, enum bool_mode bmode,
-            const char *file, uint line, const char *name, ...)
-{
-    va_list ap;
-    uint result;
-    va_start(ap, name);
-
-    if (!(result = __ok(!strcmp(got, expected), bmode, file, line, name, ap))) {
-        GOT("     got", "%s", got);
-        EXP("expected", "%s", expected);
-    }
-
-    va_end(ap);
-    return result;
-}
+            const char *file, uint line, const char *name, ...);
 
 /**
  * Handy test function to compare that pointer values are same.
@@ -456,22 +369,8 @@ int _is_str(const char *got, const char *expected, enum bool_mode bmode,
  * @param name     a short description of test.
  */
 #define isnt_p(got, expected, ...) _is_p(got, expected, COND_FALSE, FL, ""__VA_ARGS__)
-
 int _is_p(const void *got, const void *expected, enum bool_mode bmode,
-          const char *file, uint line, const char *name, ...)
-{
-    va_list ap;
-    uint result;
-    va_start(ap, name);
-
-    if (!(result = __ok((got == expected), bmode, file, line, name, ap))) {
-        GOT("     got", "%p", got);
-        EXP("expected", "%p", expected);
-    }
-
-    va_end(ap);
-    return result;
-}
+          const char *file, uint line, const char *name, ...);
 
 /**
  * Handy test function to compare that two memory spaces are same.
@@ -498,22 +397,292 @@ int _is_p(const void *got, const void *expected, enum bool_mode bmode,
  * @param name     a short description of test.
  */
 #define isnt_mem(got, expected, size, ...) _is_mem(got, expected, size, COND_FALSE, FL, ""__VA_ARGS__)
-
 int _is_mem(const void *got, const void *expected, size_t size, enum bool_mode bmode,
-            const char *file, uint line, const char *name, ...)
-{
-    va_list ap;
-    uint result;
-    va_start(ap, name);
+            const char *file, uint line, const char *name, ...);
 
-    if (!(result = __ok(!memcmp(got, expected, size), bmode, file, line, name, ap))) {
-        GOT("     got", "%p(+0x%x)", got, size);
-        EXP("expected", "%p(+0x%x)", expected, size);
-    }
+/**
+ * Initialize a streaming content hash.
+ *
+ * @param hash a hash state to initialize.
+ */
+void ctap_hash_init(ctap_hash_t *hash);
 
-    va_end(ap);
-    return result;
-}
+/**
+ * Feed a memory space to a streaming content hash.
+ * Input is consumed in 32 bytes stripes by four independent lanes, so it runs near memory bandwidth.
+ *
+ * @param hash a hash state.
+ * @param buf  a address that pointing memory to hash.
+ * @param size a memory size of buf.
+ */
+void ctap_hash_update(ctap_hash_t *hash, const void *buf, size_t size);
+
+/**
+ * Compute the digest of a streaming content hash. The state is not modified.
+ *
+ * @param hash a hash state.
+ * @return a 64 bit digest.
+ */
+uint64_t ctap_hash_digest(const ctap_hash_t *hash);
+
+/**
+ * Handy test function to compare the content hash of a memory space with an expected hash.
+ * Useful for large outputs which are too big to store as expected buffers.
+ * On mismatch the hash of got is reported in the same form as expected, so you can copy it.
+ *
+ *     is_hash(got, size, "xxh64:ef46db3751d8e999");
+ *     is_hash(got, size, "xxh64:ef46db3751d8e999", name, ...);
+ *
+ * @param got      a address that pointing memory that you've got.
+ * @param size     a memory size of got.
+ * @param expected a hash string in the form of "xxh64:<16 hex digits>".
+ * @param name     a short description of test.
+ */
+#define   is_hash(got, size, expected, ...) _is_hash(got, size, expected, COND_TRUE , FL, ""__VA_ARGS__)
+
+/**
+ * Handy test function to compare the content hash of a memory space is not an expected hash.
+ *
+ *     isnt_hash(got, size, "xxh64:ef46db3751d8e999");
+ *     isnt_hash(got, size, "xxh64:ef46db3751d8e999", name, ...);
+ *
+ * @param got      a address that pointing memory that you've got.
+ * @param size     a memory size of got.
+ * @param expected a hash string in the form of "xxh64:<16 hex digits>".
+ * @param name     a short description of test.
+ */
+#define isnt_hash(got, size, expected, ...) _is_hash(got, size, expected, COND_FALSE, FL, ""__VA_ARGS__)
+int _is_hash(const void *got, size_t size, const char *expected, enum bool_mode bmode,
+             const char *file, uint line, const char *name, ...);
+
+/**
+ * Handy test function to compare the digest of a streaming content hash with an expected hash.
+ *
+ *     is_hash_final(&hash, "xxh64:ef46db3751d8e999");
+ *     is_hash_final(&hash, "xxh64:ef46db3751d8e999", name, ...);
+ *
+ * @see ctap_hash_init()
+ * @param hash     a hash state fed by ctap_hash_update().
+ * @param expected a hash string in the form of "xxh64:<16 hex digits>".
+ * @param name     a short description of test.
+ */
+#define is_hash_final(hash, expected, ...) _is_hash_final(hash, expected, COND_TRUE, FL, ""__VA_ARGS__)
+int _is_hash_final(const ctap_hash_t *hash, const char *expected, enum bool_mode bmode,
+                   const char *file, uint line, const char *name, ...);
+
+/**
+ * Handy test function to check that the subtest made I/O within a budget.
+ * I/O is measured by /proc/self/io since plan() of the running subtest (or the main test),
+ * excluding I/O made by ctap itself. Only read(2) and write(2) family syscalls are counted,
+ * so other syscalls like fsync(2) or open(2) are not seen by these budgets.
+ * The measured counters are reported as a YAML block following the TAP line.
+ * Run the test with CTAP_IO_BUDGET=1 to measure I/O, which costs a read of /proc/self/io
+ * per plan() and subtest(). Otherwise, or if /proc/self/io is not available, the test is skipped.
+ * I/O is counted per process, so these fail when called from func of stress().
+ *
+ *     is_rw_calls_at_most(10);
+ *     is_read_calls_at_most(4, name, ...);
+ *     is_write_calls_at_most(1, name, ...);
+ *     is_bytes_read_at_most(4096, name, ...);
+ *     is_bytes_written_at_most(4096, name, ...);
+ *
+ * @param budget a maximum number of read/write syscalls or bytes that you've expected.
+ * @param name   a short description of test.
+ */
+#define      is_rw_calls_at_most(budget, ...) _is_io_at_most(CTAP_IO_RW_CALLS,      budget, FL, ""__VA_ARGS__)
+#define    is_read_calls_at_most(budget, ...) _is_io_at_most(CTAP_IO_READ_CALLS,    budget, FL, ""__VA_ARGS__)
+#define   is_write_calls_at_most(budget, ...) _is_io_at_most(CTAP_IO_WRITE_CALLS,   budget, FL, ""__VA_ARGS__)
+#define    is_bytes_read_at_most(budget, ...) _is_io_at_most(CTAP_IO_BYTES_READ,    budget, FL, ""__VA_ARGS__)
+#define is_bytes_written_at_most(budget, ...) _is_io_at_most(CTAP_IO_BYTES_WRITTEN, budget, FL, ""__VA_ARGS__)
+int _is_io_at_most(enum ctap_io_kind kind, uint64_t budget,
+                   const char *file, uint line, const char *name, ...);
+
+/**
+ * Handy test function to compare that a memory space is same as the contents of a golden file.
+ * The golden file is mapped with mmap(2) and compared in chunks, so it is never copied to heap.
+ * On mismatch the offset of the first different byte is reported.
+ * Run the test with CTAP_UPDATE_GOLDEN=1 to rewrite the golden file atomically from got.
+ *
+ *     is_file_content(got, size, path);
+ *     is_file_content(got, size, path, name, ...);
+ *
+ * @param got  a address that pointing memory that you've got.
+ * @param size a memory size of got.
+ * @param path a path of the golden file.
+ * @param name a short description of test.
+ */
+#define is_file_content(got, size, path, ...) _is_file_content(got, size, path, FL, ""__VA_ARGS__)
+int _is_file_content(const void *got, size_t size, const char *path,
+                     const char *file, uint line, const char *name, ...);
+
+/**
+ * Handy test function to compare that the contents of two files are same.
+ * Both files are mapped with mmap(2) and compared in chunks.
+ * Run the test with CTAP_UPDATE_GOLDEN=1 to rewrite the golden file atomically from got_path.
+ *
+ *     is_file_eq(got_path, golden_path);
+ *     is_file_eq(got_path, golden_path, name, ...);
+ *
+ * @param got_path    a path of the file that you've got.
+ * @param golden_path a path of the golden file.
+ * @param name        a short description of test.
+ */
+#define is_file_eq(got_path, golden_path, ...) _is_file_eq(got_path, golden_path, FL, ""__VA_ARGS__)
+int _is_file_eq(const char *got_path, const char *golden_path,
+                const char *file, uint line, const char *name, ...);
+
+/**
+ * Handy test function to check that fn_a is faster than fn_b by at least min_speedup times.
+ * Both functions are sampled CTAP_BENCH_SAMPLES times in alternating order so that drift
+ * of the clock frequency or the system load affects both of them equally.
+ * Then the one-sided Mann-Whitney U test checks that fn_a * min_speedup is faster than fn_b
+ * at the significance level of CTAP_BENCH_ALPHA. The test fails only when the claimed
+ * speedup is not supported by the samples.
+ * The speedup is reported as the median of all pairwise ratios with its 95% confidence interval.
+ *
+ *     is_faster(fast_func, slow_func, ctx, 1.2);
+ *     is_faster(fast_func, slow_func, ctx, 1.2, name, ...);
+ *
+ * @param fn_a        a function that is expected to be faster.
+ * @param fn_b        a reference function.
+ * @param ctx         a pointer that passed to both of functions.
+ * @param min_speedup a ratio of time(fn_b) / time(fn_a) that you've expected at least.
+ * @param name        a short description of test.
+ */
+#define is_faster(fn_a, fn_b, ctx, min_speedup, ...) _is_faster(fn_a, fn_b, ctx, min_speedup, FL, ""__VA_ARGS__)
+int _is_faster(void (*fn_a)(void *), void (*fn_b)(void *), void *ctx, double min_speedup,
+               const char *file, uint line, const char *name, ...);
+
+/**
+ * Handy test function to wait until a condition becomes true.
+ * The condition is checked by spinning with sched_yield(2) at first, then with sleeps
+ * growing exponentially up to CTAP_EVENTUALLY_MAX_BACKOFF_NSEC, so the test finishes
+ * as soon as the condition becomes true without a fixed sleep. The time waited is reported.
+ *
+ *     int is_done(void *ctx) { return ((struct job *)ctx)->done; }
+ *
+ *     eventually(is_done, job, 1000);
+ *     eventually(is_done, job, 1000, name, ...);
+ *
+ * @param cond       a function which returns non-zero when the condition is true.
+ * @param ctx        a pointer that passed to cond.
+ * @param timeout_ms a maximum time to wait in milliseconds.
+ * @param name       a short description of test.
+ */
+#define eventually(cond, ctx, timeout_ms, ...) _eventually(cond, ctx, timeout_ms, FL, ""__VA_ARGS__)
+int _eventually(int (*cond)(void *), void *ctx, uint timeout_ms,
+                const char *file, uint line, const char *name, ...);
+
+/**
+ * Handy test function to wait until a file descriptor becomes ready.
+ * Readiness is waited by poll(2), so the test finishes as soon as it becomes ready.
+ * Works with any pollable descriptors like pipes, sockets, eventfd(2) and timerfd_create(2).
+ * The time waited is reported.
+ *
+ *     eventually_fd(efd, POLLIN, 1000);
+ *     eventually_fd(efd, POLLIN, 1000, name, ...);
+ *
+ * @param fd         a file descriptor to wait.
+ * @param events     events to wait for, e.g. POLLIN or POLLOUT.
+ * @param timeout_ms a maximum time to wait in milliseconds.
+ * @param name       a short description of test.
+ */
+#define eventually_fd(fd, events, timeout_ms, ...) _eventually_fd(fd, events, timeout_ms, FL, ""__VA_ARGS__)
+int _eventually_fd(int fd, short events, uint timeout_ms,
+                   const char *file, uint line, const char *name, ...);
+
+/**
+ * Run the given function concurrently from many threads to find races, as a single test.
+ * Threads are pinned to distinct CPUs (as long as there are enough CPUs) and released
+ * together through a spin barrier to maximize contention. Each thread calls func iterations times.
+ * Assertions in func are collected per thread instead of being reported one by one,
+ * and the test fails if any of them failed. Throughput and imbalance between threads are reported.
+ * diag() in func is discarded except for the diagnostics of the first failure of each thread,
+ * which are reported with the result.
+ * func must not call plan(), subtest() or ctap_alloc().
+ *
+ *     void push_pop(void *ctx, uint thread)
+ *     {
+ *         ok(queue_push(ctx, thread), "push");
+ *     }
+ *
+ *     stress("Concurrent push", push_pop, queue, 8, 100000);
+ *
+ * @param name       a short description of test.
+ * @param func       a function to run, which receives ctx and the thread number from 0.
+ * @param ctx        a pointer that passed to func.
+ * @param nthreads   a number of threads.
+ * @param iterations a number of calls of func per thread.
+ */
+#define stress(name, func, ctx, nthreads, iterations) _stress(name, func, ctx, nthreads, iterations, FL)
+int _stress(const char *name, void (*func)(void *, uint), void *ctx,
+            uint nthreads, unsigned long iterations, const char *file, uint line);
+
+/**
+ * Allocate a memory space which lives until the running subtest returns.
+ * Memory is bump-pointer allocated and released in one shot when the subtest returns,
+ * so you don't need to free(3) it. Memory allocated outside of subtests lives until exit.
+ * The memory is not initialized.
+ *
+ *     char *buf = ctap_alloc(1024);
+ *
+ * @param size a size of memory space.
+ * @return an address of memory space aligned by 16 bytes.
+ */
+void *ctap_alloc(size_t size);
+
+/**
+ * Allocate a zero-initialized memory space aligned for SIMD loads and stores,
+ * which lives until the running subtest returns.
+ *
+ *     float *vec = ctap_calloc_aligned(1024, sizeof(float), 64);
+ *
+ * @see ctap_alloc()
+ * @param nmemb a number of elements.
+ * @param size  a size of element.
+ * @param align an alignment of memory space, must be a power of 2.
+ * @return an address of memory space.
+ */
+void *ctap_calloc_aligned(size_t nmemb, size_t size, size_t align);
+
+/**
+ * Allocate a buffer whose end is flush against a PROT_NONE guard page,
+ * so that an overflow by the code under test faults immediately at native speed.
+ * The end is exactly flush when size is a multiple of align.
+ * Run the test with CTAP_CATCH_SIGNALS=1 to report the fault as a failure of the running subtest.
+ * Mappings are pooled and reused by later allocations of the same number of pages.
+ *
+ *     char *buf = ctap_guarded_alloc(100, 1);
+ *     buf[100] = 0;  // SIGSEGV
+ *
+ * @see ctap_guarded_free()
+ * @param size  a size of buffer.
+ * @param align an alignment of buffer, must be a power of 2 up to the page size.
+ * @return an address of buffer.
+ */
+void *ctap_guarded_alloc(size_t size, size_t align);
+
+/**
+ * Allocate a buffer whose beginning is flush against a PROT_NONE guard page,
+ * so that an underflow by the code under test faults immediately.
+ *
+ *     char *buf = ctap_guarded_alloc_under(100, 16);
+ *     buf[-1] = 0;  // SIGSEGV
+ *
+ * @see ctap_guarded_alloc()
+ * @param size  a size of buffer.
+ * @param align an alignment of buffer, must be a power of 2 up to the page size.
+ * @return an address of buffer, aligned by the page size.
+ */
+void *ctap_guarded_alloc_under(size_t size, size_t align);
+
+/**
+ * Free a buffer allocated by ctap_guarded_alloc() or ctap_guarded_alloc_under().
+ * Up to CTAP_GUARD_POOL_MAX mappings are kept for reuse.
+ *
+ * @param ptr an address of buffer.
+ */
+void ctap_guarded_free(void *ptr);
 
 /**
  * Run the given function as its own little test with its own plan and its own result.
@@ -531,37 +700,2097 @@ int _is_mem(const void *got, const void *expected, size_t size, enum bool_mode b
  *         done_testing(-1);
  *     }
  *
+ * Run the test with CTAP_CATCH_SIGNALS=1 to recover from crashes of subtests without forking.
+ * When the subtest raises SIGSEGV, SIGBUS, SIGFPE, SIGILL or SIGABRT, it is aborted with a
+ * failed test which tells the signal and a backtrace, then the rest of the test continues.
+ * This is best-effort: memory and locks held by the crashed code are never released,
+ * and a crash inside libc (e.g. malloc(3) or stdio) may leave it unusable.
+ * Crashes on threads other than the one running the subtest are not recovered.
+ *
  * @param name a short description of subtest.
  * @param func a pointer to function which should run as a subtest.
  */
 #define subtest(name, func) _subtest(name, func, FL)
-
 int _subtest(const char *name, void (*func)(void),
-              const char *file, uint line)
+              const char *file, uint line);
+
+/**
+ * Run the given function as a subtest count times in process to detect flakiness.
+ * Each run is reported as a nested subtest, and the main test counts this as a single test
+ * which passes only if all runs passed. done_testing() of the main test reports
+ * the pass rate and the mean and standard deviation of run time of each repeated subtest.
+ * Setting CTAP_REPEAT=N runs every subtest() this way N times.
+ *
+ *     subtest_repeat("Concurrent queue", subtest_queue, 100);
+ *
+ * @param name  a short description of subtest.
+ * @param func  a pointer to function which should run as a subtest.
+ * @param count a number of runs.
+ */
+#define subtest_repeat(name, func, count) _subtest_repeat(name, func, count, FL)
+int _subtest_repeat(const char *name, void (*func)(void), uint count,
+                    const char *file, uint line);
+
+/**
+ * Run the given function as a subtest once per SIMD dispatch level that the CPU supports,
+ * setting ctap_forced_isa to the level. Each level is reported as a nested subtest
+ * with its time, and levels which are not supported by the CPU are reported as skipped.
+ * The main test counts this as a single test.
+ *
+ *     void subtest_sum(void)
+ *     {
+ *         is_int(sum(data, 1024), 523776, "sum with %s", ctap_isa_names[ctap_forced_isa]);
+ *     }
+ *
+ *     subtest_each_isa("sum", subtest_sum);
+ *
+ * @see ctap_forced_isa
+ * @param name a short description of subtest.
+ * @param func a pointer to function which should run as a subtest.
+ */
+#define subtest_each_isa(name, func) _subtest_each_isa(name, func, FL)
+int _subtest_each_isa(const char *name, void (*func)(void),
+                      const char *file, uint line);
+
+/**
+ * Run a ctap test program as a nested subtest.
+ * The child inherits stdout and stderr and indents its own TAP as a subtest of the running test,
+ * so its output goes straight into the stream of the parent without being copied.
+ * Then the child reports its result through a pipe, and the main test counts it as a single test.
+ *
+ *     char *argv[] = { "./t/cli.t", "--quick", NULL };
+ *     subtest_exec("CLI", argv);
+ *
+ * @param name a short description of subtest.
+ * @param argv arguments of the program terminated by NULL, argv[0] is searched in PATH.
+ */
+#define subtest_exec(name, argv) _subtest_exec(name, argv, FL)
+int _subtest_exec(const char *name, char *const argv[], const char *file, uint line);
+
+/**
+ * Run ctap test programs in parallel, each as a nested subtest named by its argv[0].
+ * Output of the child being reported is written straight through, and output of the others
+ * is buffered until their turn, so the TAP stream stays in order of argvs.
+ *
+ *     char *a[] = { "./t/a.t", NULL }, *b[] = { "./t/b.t", NULL };
+ *     char *const *argvs[] = { a, b };
+ *     subtest_exec_many(argvs, 2, 8);
+ *
+ * @param argvs an array of arguments of programs.
+ * @param count a number of programs.
+ * @param jobs  a maximum number of programs running at once.
+ * @return a number of programs which passed.
+ */
+#define subtest_exec_many(argvs, count, jobs) _subtest_exec_many(argvs, count, jobs, FL)
+int _subtest_exec_many(char *const *const argvs[], uint count, uint jobs,
+                       const char *file, uint line);
+
+#endif /* _CTAP_H_ */
+
+#if defined(CTAP_IMPLEMENTATION) && !defined(_CTAP_IMPLEMENTED_)
+#define _CTAP_IMPLEMENTED_
+
+#if defined(__GLIBC__) && !defined(__USE_GNU)
+#error "Define CTAP_IMPLEMENTATION (or _GNU_SOURCE) before any system header"
+#endif
+
+#include <stdlib.h>   /* exit(3)                 */
+#include <string.h>   /* strlen(3)               */
+#include <float.h>    /* DBL_EPSILON             */
+#include <math.h>     /* fabs(3)                 */
+#include <assert.h>   /* assert(3)               */
+#include <time.h>     /* clock_gettime(2)        */
+#include <errno.h>    /* errno                   */
+#include <fcntl.h>    /* open(2)                 */
+#include <unistd.h>   /* close(2), fsync(2)      */
+#include <sys/mman.h> /* mmap(2)                 */
+#include <sys/stat.h> /* fstat(2)                */
+#include <inttypes.h> /* SCNu64                  */
+#include <signal.h>   /* sigaction(2)            */
+#include <setjmp.h>   /* sigsetjmp(3)            */
+#include <execinfo.h> /* backtrace(3)            */
+#include <sched.h>    /* sched_yield(2)          */
+#include <pthread.h>  /* pthread_create(3)       */
+#include <sys/wait.h> /* waitpid(2)              */
+
+/* I/O counters of /proc/self/io */
+struct ctap_io {
+    uint64_t rchar;
+    uint64_t wchar;
+    uint64_t syscr;
+    uint64_t syscw;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+};
+
+/* I/O counters of the process, and of ctap itself to be excluded from them */
+struct ctap_io_snapshot {
+    int            valid;
+    struct ctap_io proc;
+    struct ctap_io self;
+};
+
+static struct {
+    int  plan;
+    uint run;
+    uint pass;
+    uint fail;
+    struct ctap_io_snapshot io;
+} tests[SUBTEST_MAX_DEPTH];
+
+static uint current;
+
+#define TESTS_PLAN tests[current].plan
+#define TESTS_RUN  tests[current].run
+#define TESTS_PASS tests[current].pass
+#define TESTS_FAIL tests[current].fail
+
+static FILE *tapout;
+static FILE *msgout;
+
+/* Set by subtest_exec() of the parent test: indent of the main test and where to report the result */
+static uint indent_base;
+static int  result_fd = -1;
+
+static struct ctap_status *status;
+
+/* I/O made by ctap itself: its output and reads of /proc/self/io */
+static struct ctap_io io_self;
+
+/* I/O is measured by plan() only if enabled by CTAP_IO_BUDGET=1 */
+static int io_budget;
+
+/* Set while an assertion has diagnostics to print before done_testing() of the plan */
+static int defer_done;
+
+/* Signal based crash recovery of subtests, enabled by CTAP_CATCH_SIGNALS=1 */
+static int        catch_signals;
+static sigjmp_buf subtest_jmp[SUBTEST_MAX_DEPTH];
+static pthread_t  subtest_thread;
+static void      *crash_trace[CTAP_BACKTRACE_DEPTH];
+static int        crash_trace_size;
+static void      *crash_addr;
+
+/* Bump pointer arenas of ctap_alloc(), one per subtest depth */
+struct ctap_arena_chunk {
+    struct ctap_arena_chunk *next;
+    size_t size;
+    size_t used;
+};
+static struct ctap_arena_chunk *arenas[SUBTEST_MAX_DEPTH];
+static int arena_hugepages;
+
+/* Mappings of ctap_guarded_alloc(): a guard page, data pages, then a guard page */
+struct ctap_guarded {
+    struct ctap_guarded *next;
+    char  *map;
+    size_t npages;
+    char  *ptr;
+    size_t size;
+};
+static struct ctap_guarded *guarded_live, *guarded_pool;
+static uint guarded_npool;
+
+/* A worker thread of stress(), its assertions are recorded instead of reported */
+struct ctap_stress_thread {
+    pthread_t     thread;
+    uint          id;
+    void        (*fn)(void *, uint);
+    void         *ctx;
+    unsigned long iterations;
+    volatile uint *arrived;
+    volatile int  *go;
+    double        elapsed;
+    uint          run;
+    uint          fail;
+    const char   *fail_file;
+    uint          fail_line;
+    char          fail_name[128];
+    int           fail_diag_open;
+    size_t        fail_diaglen;
+    char          fail_diag[256];
+};
+static __thread struct ctap_stress_thread *stress_self;
+
+/* Statistics of repeated subtests, reported by done_testing() of the main test */
+static struct {
+    const char *name;
+    uint        runs;
+    uint        pass;
+    double      mean;
+    double      m2;
+} repeats[CTAP_REPEAT_MAX];
+static uint nrepeats;
+static uint repeat_env;
+static int  repeating;
+
+enum ctap_isa ctap_forced_isa = CTAP_ISA_NONE;
+
+/* Used to handy output 'got - expected' pair in _is_* functions */
+#define GOT(got, fmt, ...)      diag("    %s: " fmt "\n", got, ##__VA_ARGS__)
+#define EXP(expected, fmt, ...) diag("    %s: " fmt "\n", (bmode == COND_FALSE) ? "anything else" : expected, ##__VA_ARGS__)
+
+
+/**
+ * Print a whitespace to make indent.
+ */
+static inline void pindent(FILE *out)
 {
-    uint subtestp;
+    fprintf(out, "%*s", INDENT_LEVEL*(indent_base + current), "");
+}
 
-    // Push tests status stack
-    if (++current == SUBTEST_MAX_DEPTH) {
-        bail("Too deep subtest nesting. You can change macro SUBTEST_MAX_DEPTH to change this value.");
+/**
+ * Signal handler of crash recovery. This function is internally use only.
+ * Jump back to the innermost running subtest, or die as usual if no subtest is running
+ * or the fault happened on a thread other than the one running subtests.
+ */
+static void _ctap_crash_handler(int sig, siginfo_t *info, void *uctx)
+{
+    (void)uctx;
+
+    if (current == 0 || stress_self || !pthread_equal(pthread_self(), subtest_thread)) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return;
     }
+    crash_addr       = info->si_addr;
+    crash_trace_size = backtrace(crash_trace, CTAP_BACKTRACE_DEPTH);
+    siglongjmp(subtest_jmp[current], sig);
+}
 
-    plan(-1);
-    func();
-    
-    done_testing(-1);
+/**
+ * Install handlers of crash recovery on an alternate signal stack,
+ * so that stack overflows can be caught as well. This function is internally use only.
+ */
+static void _ctap_install_crash_handlers(void)
+{
+    static const int signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    struct sigaction sa;
+    stack_t ss;
+    uint i;
+
+    if ((ss.ss_sp = malloc(CTAP_ALTSTACK_SIZE)) == NULL)
+        return;
+    ss.ss_size  = CTAP_ALTSTACK_SIZE;
+    ss.ss_flags = 0;
+    if (sigaltstack(&ss, NULL) < 0)
+        return;
+
+    /* backtrace(3) loads libgcc lazily, which is not safe to do in a signal handler */
+    crash_trace_size = backtrace(crash_trace, 1);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = _ctap_crash_handler;
+    sa.sa_flags     = SA_ONSTACK | SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    for (i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+        sigaction(signals[i], &sa, NULL);
+
+    catch_signals = 1;
+}
 
-    // Pop tests status stack
-    subtestp = current--;
+static const char *_ctap_signame(int sig)
+{
+    switch (sig) {
+    case SIGSEGV: return "SIGSEGV";
+    case SIGBUS:  return "SIGBUS";
+    case SIGFPE:  return "SIGFPE";
+    case SIGILL:  return "SIGILL";
+    case SIGABRT: return "SIGABRT";
+    default:      return "unknown signal";
+    }
+}
 
-    assert(current >= 0);
+/**
+ * Write function of the output streams, which counts I/O made by ctap itself.
+ * This function is internally use only.
+ */
+static ssize_t _ctap_output_write(void *cookie, const char *buf, size_t size)
+{
+    int fd = (int)(intptr_t)cookie;
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < size) {
+        if ((n = write(fd, buf + done, size - done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return done ? (ssize_t)done : -1;
+        }
+        io_self.syscw++;
+        io_self.wchar += n;
+        done += n;
+    }
+    return done;
+}
 
-    uint sub_result;
-    if (tests[subtestp].run == 0) {
-        sub_result = _fail(file, line, "No tests run for subtest \"%s\"", name);
-    } else {
-        sub_result = __ok((tests[subtestp].run == tests[subtestp].pass), 0, file, line, name, NULL);
+/**
+ * Open an output stream writing to the file descriptor. This function is internally use only.
+ */
+static FILE *_ctap_open_output(int fd)
+{
+    cookie_io_functions_t funcs = { NULL, _ctap_output_write, NULL, NULL };
+    return fopencookie((void *)(intptr_t)fd, "w", funcs);
+}
+
+/**
+ * Take a snapshot of I/O counters. This function is internally use only.
+ * Reading /proc/self/io is itself counted by the next snapshot, so it is recorded in io_self.
+ */
+static void _ctap_io_snapshot(struct ctap_io_snapshot *snap)
+{
+    char buf[512], *p;
+    ssize_t n;
+    int fd;
+
+    snap->self  = io_self;
+    snap->valid = 0;
+
+    if ((fd = open("/proc/self/io", O_RDONLY)) < 0)
+        return;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return;
+    io_self.syscr++;
+    io_self.rchar += n;
+    buf[n] = '\0';
+
+    memset(&snap->proc, 0, sizeof(snap->proc));
+    for (p = buf; p && *p; p = strchr(p, '\n'), p = p ? p + 1 : NULL) {
+        sscanf(p, "rchar: %" SCNu64, &snap->proc.rchar);
+        sscanf(p, "wchar: %" SCNu64, &snap->proc.wchar);
+        sscanf(p, "syscr: %" SCNu64, &snap->proc.syscr);
+        sscanf(p, "syscw: %" SCNu64, &snap->proc.syscw);
+        sscanf(p, "read_bytes: %" SCNu64, &snap->proc.read_bytes);
+        sscanf(p, "write_bytes: %" SCNu64, &snap->proc.write_bytes);
     }
+    snap->valid = 1;
 }
 
-#endif /* _CTAP_H_ */
+/**
+ * Read the monotonic clock in nanoseconds. This function is internally use only.
+ */
+static inline double _ctap_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Create the status block on the file. This function is internally use only.
+ */
+static void _ctap_status_open(const char *path)
+{
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+        return;
+    if (ftruncate(fd, sizeof(*status)) == 0) {
+        status = mmap(NULL, sizeof(*status), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (status == MAP_FAILED)
+            status = NULL;
+    }
+    close(fd);
+    if (status == NULL)
+        return;
+
+    status->version  = CTAP_STATUS_VERSION;
+    status->pid      = getpid();
+    status->start_ns = _ctap_now_ns();
+    __atomic_store_n(&status->magic, CTAP_STATUS_MAGIC, __ATOMIC_RELEASE);
+}
+
+/**
+ * Publish the counters of the running (sub)test to the status block. This function is internally use only.
+ */
+static inline void _ctap_status_update(int assertion)
+{
+    if (status == NULL || current >= CTAP_STATUS_DEPTH)
+        return;
+    __atomic_store_n(&status->tests[current].run,  TESTS_RUN,  __ATOMIC_RELAXED);
+    __atomic_store_n(&status->tests[current].pass, TESTS_PASS, __ATOMIC_RELAXED);
+    __atomic_store_n(&status->tests[current].fail, TESTS_FAIL, __ATOMIC_RELAXED);
+    if (assertion) {
+        __atomic_store_n(&status->update_ns, (uint64_t)_ctap_now_ns(), __ATOMIC_RELAXED);
+        __atomic_add_fetch(&status->assertions, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Publish the depth and the name of the running subtest to the status block. This function is internally use only.
+ */
+static void _ctap_status_enter(const char *name)
+{
+    if (status == NULL)
+        return;
+    __atomic_add_fetch(&status->seq, 1, __ATOMIC_ACQ_REL);
+    if (current < CTAP_STATUS_DEPTH && name) {
+        strncpy(status->tests[current].name, name, CTAP_STATUS_NAME_MAX - 1);
+        status->tests[current].name[CTAP_STATUS_NAME_MAX - 1] = '\0';
+    }
+    status->depth = current;
+    __atomic_add_fetch(&status->seq, 1, __ATOMIC_RELEASE);
+}
+
+void bail(char *why, ...)
+{
+    va_list ap;
+    va_start(ap, why);
+    vfprintf(msgout, why, ap);
+    va_end(ap);
+    exit(255);
+}
+
+void diag(const char *msg, ...)
+{
+    struct ctap_stress_thread *self = stress_self;
+    va_list ap;
+    int n;
+    va_start(ap, msg);
+    if (self) {
+        /* Called from a worker thread of stress(), printed with its summary */
+        if (self->fail_diag_open && self->fail_diaglen < sizeof(self->fail_diag)) {
+            n = vsnprintf(self->fail_diag + self->fail_diaglen,
+                          sizeof(self->fail_diag) - self->fail_diaglen, msg, ap);
+            if (n > 0)
+                self->fail_diaglen += n;
+        }
+    } else {
+        vfprintf(msgout, msg, ap);
+    }
+    va_end(ap);
+}
+
+void plan(int ntests)
+{
+    /* Initialize output stream for TAP output and messages output */
+    if (tapout == NULL || msgout == NULL) {
+        /* TAP messages are should be writen to stdout */
+        if ((tapout = _ctap_open_output(fileno(stdout))) == NULL)
+            bail("Failed to fdopen stdout: ");
+        if (setvbuf(tapout, NULL, _IONBF, 0) != 0)
+            bail("Failed to setvbuf to TAP output: ");
+        /* Comments are should be writen to stderr */
+        if ((msgout = _ctap_open_output(fileno(stderr))) == NULL)
+            bail("Failed to fdopen stderr: ");
+        if (setvbuf(msgout, NULL, _IONBF, 0) != 0)
+            bail("Failed to setvbuf to Message output: ");
+
+        if (getenv("CTAP_CATCH_SIGNALS") && !strcmp(getenv("CTAP_CATCH_SIGNALS"), "1"))
+            _ctap_install_crash_handlers();
+        if (getenv("CTAP_ARENA_HUGEPAGES") && !strcmp(getenv("CTAP_ARENA_HUGEPAGES"), "1"))
+            arena_hugepages = 1;
+        if (getenv("CTAP_IO_BUDGET") && !strcmp(getenv("CTAP_IO_BUDGET"), "1"))
+            io_budget = 1;
+        if (getenv("CTAP_REPEAT"))
+            repeat_env = atoi(getenv("CTAP_REPEAT"));
+        if (getenv("CTAP_STATUS_FILE"))
+            _ctap_status_open(getenv("CTAP_STATUS_FILE"));
+
+        /* Run as a nested subtest by subtest_exec(), not inherited by grandchildren */
+        if (getenv("CTAP_INDENT") && getenv("CTAP_RESULT_FD")) {
+            indent_base = atoi(getenv("CTAP_INDENT"));
+            result_fd   = atoi(getenv("CTAP_RESULT_FD"));
+            fcntl(result_fd, F_SETFD, FD_CLOEXEC);
+        }
+        unsetenv("CTAP_INDENT");
+        unsetenv("CTAP_RESULT_FD");
+    }
+
+    TESTS_PLAN = ntests;
+    TESTS_RUN = TESTS_PASS = TESTS_FAIL = 0;
+    if (io_budget)
+        _ctap_io_snapshot(&tests[current].io);
+    else
+        tests[current].io.valid = 0;
+    _ctap_status_update(0);
+}
+
+void done_testing(int ntests)
+{
+    if (ntests < 0) {
+        TESTS_PLAN = TESTS_RUN;
+    }
+
+    pindent(tapout);
+    fprintf(tapout, "1..%d\n", TESTS_RUN);
+    if (TESTS_RUN != TESTS_PLAN) {
+        pindent(msgout);
+        fprintf(msgout, "# Looks like you planned %u tests but run %u\n", TESTS_PLAN, TESTS_RUN);
+    }
+    if (TESTS_FAIL) {
+        pindent(msgout);
+        fprintf(msgout, "# Looks like you failed %u test of %u\n", TESTS_FAIL, TESTS_RUN);
+    }
+
+    if (current == 0 && status)
+        __atomic_store_n(&status->finished, 1, __ATOMIC_RELEASE);
+
+    /* Report the result to the parent test of subtest_exec() */
+    if (current == 0 && result_fd >= 0)
+        dprintf(result_fd, "%d %u %u %u\n", TESTS_PLAN, TESTS_RUN, TESTS_PASS, TESTS_FAIL);
+
+    if (current == 0 && nrepeats) {
+        uint i;
+        fprintf(msgout, "# Repeated subtests:\n");
+        for (i = 0; i < nrepeats; i++) {
+            fprintf(msgout, "#   %s: %u/%u passed%s, %.3f ms +- %.3f ms\n",
+                    repeats[i].name, repeats[i].pass, repeats[i].runs,
+                    (repeats[i].pass && repeats[i].pass < repeats[i].runs) ? " (flaky)" : "",
+                    repeats[i].mean / 1e6,
+                    (repeats[i].runs > 1) ? sqrt(repeats[i].m2 / (repeats[i].runs - 1)) / 1e6 : 0.0);
+        }
+    }
+}
+
+
+/**
+ * A very core function of testing framework. This function is internally use only.
+ * Check the result of test, increment the test counters.
+ * Then output TAP messages and messages for users.
+ * Call done_testing() if the number of tests ran is equals to the number of tests planned
+ *
+ * @see done_testing()
+ * @param test  a result of test. 0 for fail, other for pass.
+ * @param bmode a boolean mode for test result. If it is set to COND_FALSE, test result will reversed on evaluation.
+ * @param file  a filename of this test has been ran.
+ * @param line  a line number of the file where this test has been ran.
+ * @param name  a short description of test.
+ * @param ap    a argument that should pass to vfprintf(3) with name
+ */
+int __ok(uint test, enum bool_mode bmode,
+         const char *file, uint line, const char *name, va_list ap)
+{
+    va_list ap_copy;
+    uint namelen = strlen(name);
+
+    /* Called from a worker thread of stress() */
+    if (stress_self) {
+        if (bmode == COND_FALSE) test = !test;
+        stress_self->run++;
+        /* Keep diagnostics of the first failure only */
+        stress_self->fail_diag_open = 0;
+        if (!test && stress_self->fail++ == 0) {
+            stress_self->fail_diag_open = 1;
+            stress_self->fail_file = file;
+            stress_self->fail_line = line;
+            vsnprintf(stress_self->fail_name, sizeof(stress_self->fail_name), name, ap);
+        }
+        return test;
+    }
+
+    va_copy(ap_copy, ap);
+
+    TESTS_RUN++;
+    pindent(tapout);
+
+    if (bmode == COND_FALSE) test = !test;
+
+    if (!test) fputs("not ", tapout);
+
+    fprintf(tapout, "ok %d", TESTS_RUN);
+
+    /* Print tests name if specified */
+    if (namelen) {
+        fputs(" - ", tapout);
+        vfprintf(tapout, name, ap);
+    }
+    fputc('\n', tapout);
+
+    if (test) {
+        TESTS_PASS++;
+    } else {
+        TESTS_FAIL++;
+
+        /* Expecing output example:
+         * #   Failed test at test.c line 10.
+         * #   Failed test "MyTest" at test.c line 10.
+         */
+
+        pindent(msgout);
+        fputs("#   Failed test", msgout);
+        if (namelen) {
+            fputs(" \"", msgout);
+            vfprintf(msgout, name, ap_copy);
+            fputc('"', msgout);
+        }
+        fprintf(msgout, " at %s line %u\n", file, line);
+    }
+
+    _ctap_status_update(1);
+
+    if (TESTS_RUN == TESTS_PLAN && !defer_done)
+        done_testing(TESTS_PLAN);
+
+    return test;
+}
+
+/**
+ * Inform a test has been skipped. This function is internally use only.
+ * A skipped test is counted as passed.
+ *
+ * @param why a reason of skipping test.
+ */
+static void _ctap_skip(const char *why, ...)
+{
+    va_list ap;
+    va_start(ap, why);
+
+    TESTS_RUN++;
+    TESTS_PASS++;
+    pindent(tapout);
+    fprintf(tapout, "ok %d # SKIP ", TESTS_RUN);
+    vfprintf(tapout, why, ap);
+    fputc('\n', tapout);
+
+    va_end(ap);
+
+    _ctap_status_update(1);
+
+    if (TESTS_RUN == TESTS_PLAN)
+        done_testing(TESTS_PLAN);
+}
+
+int _pass(const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    va_start(ap, name);
+    __ok(1, COND_TRUE, file, line, name, ap);
+    va_end(ap);
+
+    return 1;
+}    
+
+int _fail(const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    va_start(ap, name);
+    __ok(0, COND_TRUE, file, line, name, ap);
+    va_end(ap);
+
+    return 0;
+}    
+
+int _ok(uint test, enum bool_mode bmode,
+        const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    uint result;
+    va_start(ap, name);
+
+    result = __ok(test, bmode, file, line, name, ap);
+
+    va_end(ap);
+    return result;
+}
+
+int _is_int(long got, long expected, enum bool_mode bmode,
+            const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    uint result;
+    va_start(ap, name);
+
+    if (!(result = __ok((got == expected), bmode, file, line, name, ap))) {
+        GOT("     got", "%ld", got);
+        EXP("expected", "%ld", expected);
+    }
+
+    va_end(ap);
+    return result;
+}
+
+int _is_double(double got, double expected, enum bool_mode bmode,
+               const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    uint result;
+    va_start(ap, name);
+
+    if (!(result = __ok((fabs(got - expected) < DBL_EPSILON), bmode, file, line, name, ap))) {
+        GOT("     got", "%g", got);
+        EXP("expected", "%g", expected);
+    }
+
+    va_end(ap);
+    return result;
+}
+
+int _is_char(char got, char expected, enum bool_mode bmode,
+             const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    uint result;
+    va_start(ap, name);
+
+    if (!(result = __ok((got == expected), bmode, file, line, name, ap))) {
+        GOT("     got", "%c", got);
+        EXP("expected", "%c", expected);
+    }
+
+    va_end(ap);
+    return result;
+}
+
+int _is_str(const char *got, const char *expected, enum bool_mode bmode,
+            const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    uint result;
+    va_start(ap, name);
+
+    if (!(result = __ok(!strcmp(got, expected), bmode, file, line, name, ap))) {
+        GOT("     got", "%s", got);
+        EXP("expected", "%s", expected);
+    }
+
+    va_end(ap);
+    return result;
+}
+
+int _is_p(const void *got, const void *expected, enum bool_mode bmode,
+          const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    uint result;
+    va_start(ap, name);
+
+    if (!(result = __ok((got == expected), bmode, file, line, name, ap))) {
+        GOT("     got", "%p", got);
+        EXP("expected", "%p", expected);
+    }
+
+    va_end(ap);
+    return result;
+}
+
+int _is_mem(const void *got, const void *expected, size_t size, enum bool_mode bmode,
+            const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    uint result;
+    va_start(ap, name);
+
+    if (!(result = __ok(!memcmp(got, expected, size), bmode, file, line, name, ap))) {
+        GOT("     got", "%p(+0x%x)", got, size);
+        EXP("expected", "%p(+0x%x)", expected, size);
+    }
+
+    va_end(ap);
+    return result;
+}
+
+#define CTAP_XXH_P1 11400714785074694791ULL
+#define CTAP_XXH_P2 14029467366897019727ULL
+#define CTAP_XXH_P3  1609587929392839161ULL
+#define CTAP_XXH_P4  9650029242287828579ULL
+#define CTAP_XXH_P5  2870177450012600261ULL
+
+#define CTAP_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t _ctap_read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint32_t _ctap_read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static inline uint64_t _ctap_xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * CTAP_XXH_P2;
+    acc  = CTAP_ROTL64(acc, 31);
+    return acc * CTAP_XXH_P1;
+}
+
+static inline uint64_t _ctap_xxh_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= _ctap_xxh_round(0, val);
+    return acc * CTAP_XXH_P1 + CTAP_XXH_P4;
+}
+
+void ctap_hash_init(ctap_hash_t *hash)
+{
+    hash->v[0]    = CTAP_XXH_P1 + CTAP_XXH_P2;
+    hash->v[1]    = CTAP_XXH_P2;
+    hash->v[2]    = 0;
+    hash->v[3]    = -CTAP_XXH_P1;
+    hash->total   = 0;
+    hash->memsize = 0;
+}
+
+void ctap_hash_update(ctap_hash_t *hash, const void *buf, size_t size)
+{
+    const unsigned char *p = buf, *end = p + size;
+    uint64_t v0, v1, v2, v3;
+
+    hash->total += size;
+
+    if (hash->memsize + size < 32) {
+        memcpy(hash->mem + hash->memsize, p, size);
+        hash->memsize += size;
+        return;
+    }
+
+    v0 = hash->v[0]; v1 = hash->v[1]; v2 = hash->v[2]; v3 = hash->v[3];
+
+    if (hash->memsize) {
+        memcpy(hash->mem + hash->memsize, p, 32 - hash->memsize);
+        p += 32 - hash->memsize;
+        v0 = _ctap_xxh_round(v0, _ctap_read64(hash->mem));
+        v1 = _ctap_xxh_round(v1, _ctap_read64(hash->mem + 8));
+        v2 = _ctap_xxh_round(v2, _ctap_read64(hash->mem + 16));
+        v3 = _ctap_xxh_round(v3, _ctap_read64(hash->mem + 24));
+        hash->memsize = 0;
+    }
+
+    for (; p + 32 <= end; p += 32) {
+        v0 = _ctap_xxh_round(v0, _ctap_read64(p));
+        v1 = _ctap_xxh_round(v1, _ctap_read64(p + 8));
+        v2 = _ctap_xxh_round(v2, _ctap_read64(p + 16));
+        v3 = _ctap_xxh_round(v3, _ctap_read64(p + 24));
+    }
+
+    hash->v[0] = v0; hash->v[1] = v1; hash->v[2] = v2; hash->v[3] = v3;
+
+    memcpy(hash->mem, p, end - p);
+    hash->memsize = end - p;
+}
+
+uint64_t ctap_hash_digest(const ctap_hash_t *hash)
+{
+    const unsigned char *p = hash->mem, *end = p + hash->memsize;
+    uint64_t h;
+    uint i;
+
+    if (hash->total >= 32) {
+        h = CTAP_ROTL64(hash->v[0], 1) + CTAP_ROTL64(hash->v[1], 7) +
+            CTAP_ROTL64(hash->v[2], 12) + CTAP_ROTL64(hash->v[3], 18);
+        for (i = 0; i < 4; i++)
+            h = _ctap_xxh_merge(h, hash->v[i]);
+    } else {
+        h = hash->v[2] + CTAP_XXH_P5;
+    }
+    h += hash->total;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= _ctap_xxh_round(0, _ctap_read64(p));
+        h  = CTAP_ROTL64(h, 27) * CTAP_XXH_P1 + CTAP_XXH_P4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)_ctap_read32(p) * CTAP_XXH_P1;
+        h  = CTAP_ROTL64(h, 23) * CTAP_XXH_P2 + CTAP_XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * CTAP_XXH_P5;
+        h  = CTAP_ROTL64(h, 11) * CTAP_XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= CTAP_XXH_P2;
+    h ^= h >> 29;
+    h *= CTAP_XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/**
+ * Parse an expected hash string like "xxh64:ef46db3751d8e999". This function is internally use only.
+ *
+ * @return 0 on success, -1 if the string is malformed or names an unsupported algorithm.
+ */
+static int _ctap_parse_hash(const char *expected, uint64_t *digest)
+{
+    const char *hex;
+
+    if (strncmp(expected, "xxh64:", 6) != 0)
+        return -1;
+    hex = expected + 6;
+    if (strlen(hex) != 16 || strspn(hex, "0123456789abcdefABCDEF") != 16)
+        return -1;
+
+    *digest = strtoull(hex, NULL, 16);
+    return 0;
+}
+
+/**
+ * Compare a digest with an expected hash string and report the result. This function is internally use only.
+ */
+static int _ctap_check_hash(uint64_t got, const char *expected, enum bool_mode bmode,
+                            const char *file, uint line, const char *name, va_list ap)
+{
+    uint64_t digest;
+    uint result;
+
+    if (_ctap_parse_hash(expected, &digest) < 0) {
+        result = __ok(0, COND_TRUE, file, line, name, ap);
+        GOT("   error", "malformed or unsupported hash \"%s\"", expected);
+        return result;
+    }
+
+    if (!(result = __ok((got == digest), bmode, file, line, name, ap))) {
+        GOT("     got", "xxh64:%016llx", (unsigned long long)got);
+        EXP("expected", "%s", expected);
+    }
+    return result;
+}
+
+int _is_hash(const void *got, size_t size, const char *expected, enum bool_mode bmode,
+             const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    uint result;
+    ctap_hash_t hash;
+    va_start(ap, name);
+
+    ctap_hash_init(&hash);
+    ctap_hash_update(&hash, got, size);
+    result = _ctap_check_hash(ctap_hash_digest(&hash), expected, bmode, file, line, name, ap);
+
+    va_end(ap);
+    return result;
+}
+
+int _is_hash_final(const ctap_hash_t *hash, const char *expected, enum bool_mode bmode,
+                   const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    uint result;
+    va_start(ap, name);
+
+    result = _ctap_check_hash(ctap_hash_digest(hash), expected, bmode, file, line, name, ap);
+
+    va_end(ap);
+    return result;
+}
+
+int _is_io_at_most(enum ctap_io_kind kind, uint64_t budget,
+                   const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    uint result;
+    struct ctap_io_snapshot now, *base = &tests[current].io;
+    struct ctap_io d;
+    uint64_t used = 0;
+    va_start(ap, name);
+
+    /* I/O is measured per process, and the YAML block cannot be collected by stress() */
+    if (stress_self) {
+        __ok(0, COND_TRUE, file, line, name, ap);
+        diag("    is_*_at_most() cannot be used in stress()\n");
+        va_end(ap);
+        return 0;
+    }
+    if (!io_budget) {
+        _ctap_skip("I/O is not measured, run with CTAP_IO_BUDGET=1");
+        va_end(ap);
+        return 1;
+    }
+    _ctap_io_snapshot(&now);
+    if (!now.valid || !base->valid) {
+        _ctap_skip("/proc/self/io is not available");
+        va_end(ap);
+        return 1;
+    }
+
+#define CTAP_IO_DELTA(f) (d.f = (now.proc.f - base->proc.f) - (now.self.f - base->self.f))
+    CTAP_IO_DELTA(rchar);
+    CTAP_IO_DELTA(wchar);
+    CTAP_IO_DELTA(syscr);
+    CTAP_IO_DELTA(syscw);
+    CTAP_IO_DELTA(read_bytes);
+    CTAP_IO_DELTA(write_bytes);
+#undef CTAP_IO_DELTA
+
+    switch (kind) {
+    case CTAP_IO_RW_CALLS:      used = d.syscr + d.syscw; break;
+    case CTAP_IO_READ_CALLS:    used = d.syscr;           break;
+    case CTAP_IO_WRITE_CALLS:   used = d.syscw;           break;
+    case CTAP_IO_BYTES_READ:    used = d.rchar;           break;
+    case CTAP_IO_BYTES_WRITTEN: used = d.wchar;           break;
+    }
+
+    defer_done = 1;
+    result = __ok((used <= budget), COND_TRUE, file, line, name, ap);
+    defer_done = 0;
+
+    /* TAP 13 YAML diagnostics, which must precede the plan line */
+    pindent(tapout); fputs("  ---\n", tapout);
+    pindent(tapout); fprintf(tapout, "  used: %" PRIu64 "\n", used);
+    pindent(tapout); fprintf(tapout, "  budget: %" PRIu64 "\n", budget);
+    pindent(tapout); fprintf(tapout, "  rw_calls: %" PRIu64 "\n", d.syscr + d.syscw);
+    pindent(tapout); fprintf(tapout, "  read_calls: %" PRIu64 "\n", d.syscr);
+    pindent(tapout); fprintf(tapout, "  write_calls: %" PRIu64 "\n", d.syscw);
+    pindent(tapout); fprintf(tapout, "  bytes_read: %" PRIu64 "\n", d.rchar);
+    pindent(tapout); fprintf(tapout, "  bytes_written: %" PRIu64 "\n", d.wchar);
+    pindent(tapout); fprintf(tapout, "  storage_bytes_read: %" PRIu64 "\n", d.read_bytes);
+    pindent(tapout); fprintf(tapout, "  storage_bytes_written: %" PRIu64 "\n", d.write_bytes);
+    pindent(tapout); fputs("  ...\n", tapout);
+
+    if ((int)TESTS_RUN == TESTS_PLAN)
+        done_testing(TESTS_PLAN);
+
+    va_end(ap);
+    return result;
+}
+
+/**
+ * Map whole of the file as read only. This function is internally use only.
+ * An empty file is mapped to a static empty buffer since mmap(2) refuses zero length.
+ *
+ * @param path a path of the file.
+ * @param size a pointer to store the size of the file.
+ * @return an address of the mapped file, or NULL with errno on error.
+ */
+static const void *_ctap_map_file(const char *path, size_t *size)
+{
+    int fd;
+    struct stat st;
+    void *addr;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    *size = st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return "";
+    }
+
+    addr = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return NULL;
+
+    madvise(addr, *size, MADV_SEQUENTIAL);
+    return addr;
+}
+
+static void _ctap_unmap_file(const void *addr, size_t size)
+{
+    if (size)
+        munmap((void *)addr, size);
+}
+
+/**
+ * Find the offset of the first different byte of two memory spaces.
+ * Memory is compared in CTAP_FILE_CHUNK sized chunks with memcmp(3), which is vectorized by libc,
+ * and the mismatched chunk is bisected to locate the exact byte.
+ *
+ * @return an offset of the first different byte, or size if they are same.
+ */
+static size_t _ctap_mismatch(const void *got, const void *expected, size_t size)
+{
+    const unsigned char *g = got, *e = expected;
+    size_t off, len;
+
+    for (off = 0; off < size; off += CTAP_FILE_CHUNK) {
+        len = (size - off < CTAP_FILE_CHUNK) ? size - off : CTAP_FILE_CHUNK;
+        if (memcmp(g + off, e + off, len) == 0)
+            continue;
+
+        while (len > 64) {
+            if (memcmp(g + off, e + off, len / 2) == 0) {
+                off += len / 2;
+                len -= len / 2;
+            } else {
+                len /= 2;
+            }
+        }
+        while (g[off] == e[off])
+            off++;
+        return off;
+    }
+    return size;
+}
+
+/**
+ * Replace the golden file atomically by writing a temporary file next to it then rename(2).
+ *
+ * @return 0 on success, -1 with errno on error.
+ */
+static int _ctap_write_golden(const char *path, const void *buf, size_t size)
+{
+    const char *p = buf;
+    char tmp[4096];
+    ssize_t n;
+    int fd, err;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((fd = mkstemp(tmp)) < 0)
+        return -1;
+
+    while (size) {
+        if ((n = write(fd, p, size)) < 0) {
+            if (errno == EINTR)
+                continue;
+            goto error;
+        }
+        p    += n;
+        size -= n;
+    }
+    if (fchmod(fd, 0644) < 0 || fsync(fd) < 0)
+        goto error;
+    if (close(fd) < 0) {
+        fd = -1;
+        goto error;
+    }
+    if (rename(tmp, path) < 0) {
+        fd = -1;
+        goto error;
+    }
+    return 0;
+
+error:
+    err = errno;
+    if (fd >= 0)
+        close(fd);
+    unlink(tmp);
+    errno = err;
+    return -1;
+}
+
+/**
+ * Compare a memory space with the golden file and report the result. This function is internally use only.
+ * If the environment variable CTAP_UPDATE_GOLDEN is set to 1, the golden file is rewritten
+ * by the contents of the memory space instead.
+ */
+static int _ctap_check_golden(const void *got, size_t size, const char *path,
+                              const char *file, uint line, const char *name, va_list ap)
+{
+    const char *update = getenv("CTAP_UPDATE_GOLDEN");
+    const unsigned char *expected;
+    size_t esize = 0, off;
+    uint result;
+
+    if (update && !strcmp(update, "1")) {
+        if ((result = __ok(_ctap_write_golden(path, got, size) == 0, COND_TRUE, file, line, name, ap)))
+            diag("    updated: %s\n", path);
+        else
+            GOT("   error", "%s: %s", path, strerror(errno));
+        return result;
+    }
+
+    if ((expected = _ctap_map_file(path, &esize)) == NULL) {
+        result = __ok(0, COND_TRUE, file, line, name, ap);
+        GOT("   error", "%s: %s", path, strerror(errno));
+        return result;
+    }
+
+    off = _ctap_mismatch(got, expected, (size < esize) ? size : esize);
+    if (!(result = __ok((off == size && size == esize), COND_TRUE, file, line, name, ap))) {
+        diag("    first mismatch at offset %zu\n", off);
+        if (off < size) GOT("     got", "0x%02x (size %zu)", ((const unsigned char *)got)[off], size);
+        else            GOT("     got", "EOF (size %zu)", size);
+        if (off < esize) GOT("expected", "0x%02x (size %zu) in %s", expected[off], esize, path);
+        else             GOT("expected", "EOF (size %zu) in %s", esize, path);
+    }
+
+    _ctap_unmap_file(expected, esize);
+    return result;
+}
+
+int _is_file_content(const void *got, size_t size, const char *path,
+                     const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    uint result;
+    va_start(ap, name);
+
+    result = _ctap_check_golden(got, size, path, file, line, name, ap);
+
+    va_end(ap);
+    return result;
+}
+
+int _is_file_eq(const char *got_path, const char *golden_path,
+                const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    uint result;
+    const void *got;
+    size_t size = 0;
+    va_start(ap, name);
+
+    if ((got = _ctap_map_file(got_path, &size)) == NULL) {
+        result = __ok(0, COND_TRUE, file, line, name, ap);
+        GOT("   error", "%s: %s", got_path, strerror(errno));
+    } else {
+        result = _ctap_check_golden(got, size, golden_path, file, line, name, ap);
+        _ctap_unmap_file(got, size);
+    }
+
+    va_end(ap);
+    return result;
+}
+
+static int _ctap_cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Run fn reps times and return the elapsed time per call in nanoseconds.
+ */
+static double _ctap_bench_sample(void (*fn)(void *), void *ctx, unsigned long reps)
+{
+    unsigned long i;
+    double start = _ctap_now_ns();
+    for (i = 0; i < reps; i++)
+        fn(ctx);
+    return (_ctap_now_ns() - start) / reps;
+}
+
+int _is_faster(void (*fn_a)(void *), void (*fn_b)(void *), void *ctx, double min_speedup,
+               const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    uint result;
+    uint i, j, k, n = CTAP_BENCH_SAMPLES;
+    unsigned long reps = 1;
+    double a[CTAP_BENCH_SAMPLES], b[CTAP_BENCH_SAMPLES];
+    double *ratios, u = 0, sd, z, p;
+    va_start(ap, name);
+
+    if ((ratios = malloc(sizeof(double) * n * n)) == NULL)
+        bail("Failed to allocate memory for benchmark samples: ");
+
+    /* Warm up caches and calibrate the number of calls per sample */
+    while (_ctap_bench_sample(fn_a, ctx, reps) * reps < CTAP_BENCH_SAMPLE_NSEC ||
+           _ctap_bench_sample(fn_b, ctx, reps) * reps < CTAP_BENCH_SAMPLE_NSEC)
+        reps *= 2;
+
+    /* Interleave samples to cancel drift */
+    for (i = 0; i < n; i++) {
+        if (i % 2) {
+            b[i] = _ctap_bench_sample(fn_b, ctx, reps);
+            a[i] = _ctap_bench_sample(fn_a, ctx, reps);
+        } else {
+            a[i] = _ctap_bench_sample(fn_a, ctx, reps);
+            b[i] = _ctap_bench_sample(fn_b, ctx, reps);
+        }
+    }
+
+    /* U statistic counts pairs which fn_a scaled by min_speedup still wins */
+    for (i = 0, k = 0; i < n; i++) {
+        for (j = 0; j < n; j++, k++) {
+            if (a[i] * min_speedup < b[j])
+                u += 1;
+            else if (a[i] * min_speedup == b[j])
+                u += 0.5;
+            ratios[k] = b[j] / a[i];
+        }
+    }
+    sd = sqrt(n * n * (2.0 * n + 1) / 12);
+    z  = (u - n * n / 2.0 - 0.5) / sd;
+    p  = 0.5 * erfc(z / sqrt(2));
+
+    /* Rank based confidence interval of the pairwise ratios */
+    qsort(ratios, n * n, sizeof(double), _ctap_cmp_double);
+    k = (uint)fmax(0, floor(n * n / 2.0 - 1.959964 * sd));
+
+    result = __ok(p < CTAP_BENCH_ALPHA, COND_TRUE, file, line, name, ap);
+    GOT(" speedup", "%.3fx (95%% CI %.3fx - %.3fx)", ratios[n * n / 2], ratios[k], ratios[n * n - 1 - k]);
+    if (!result)
+        GOT("required", "%.3fx (p = %.4f)", min_speedup, p);
+
+    free(ratios);
+    va_end(ap);
+    return result;
+}
+
+int _eventually(int (*cond)(void *), void *ctx, uint timeout_ms,
+                const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    uint result, spins = 0;
+    double start = _ctap_now_ns(), deadline = start + timeout_ms * 1e6, now;
+    struct timespec ts = { 0, 1000 };
+    va_start(ap, name);
+
+    while (!(result = cond(ctx)) && (now = _ctap_now_ns()) < deadline) {
+        if (spins < CTAP_EVENTUALLY_SPINS) {
+            spins++;
+            sched_yield();
+            continue;
+        }
+        if (ts.tv_nsec > deadline - now)
+            ts.tv_nsec = deadline - now;
+        nanosleep(&ts, NULL);
+        ts.tv_nsec *= 2;
+        if (ts.tv_nsec > CTAP_EVENTUALLY_MAX_BACKOFF_NSEC)
+            ts.tv_nsec = CTAP_EVENTUALLY_MAX_BACKOFF_NSEC;
+    }
+
+    result = __ok(result, COND_TRUE, file, line, name, ap);
+    GOT("  waited", "%.3f ms", (_ctap_now_ns() - start) / 1e6);
+    if (!result)
+        GOT(" timeout", "%u ms", timeout_ms);
+
+    va_end(ap);
+    return result;
+}
+
+int _eventually_fd(int fd, short events, uint timeout_ms,
+                   const char *file, uint line, const char *name, ...)
+{
+    va_list ap;
+    uint result;
+    int n, remain;
+    double start = _ctap_now_ns(), deadline = start + timeout_ms * 1e6;
+    struct pollfd pfd = { fd, events, 0 };
+    va_start(ap, name);
+
+    do {
+        remain = (int)ceil((deadline - _ctap_now_ns()) / 1e6);
+        n = poll(&pfd, 1, (remain > 0) ? remain : 0);
+    } while (n < 0 && errno == EINTR);
+
+    result = __ok((n > 0 && (pfd.revents & events)), COND_TRUE, file, line, name, ap);
+    GOT("  waited", "%.3f ms", (_ctap_now_ns() - start) / 1e6);
+    if (!result) {
+        if (n < 0)
+            GOT("   error", "poll: %s", strerror(errno));
+        else if (n > 0)
+            GOT(" revents", "0x%x", pfd.revents);
+        else
+            GOT(" timeout", "%u ms", timeout_ms);
+    }
+
+    va_end(ap);
+    return result;
+}
+
+/**
+ * Body of a worker thread of stress(). This function is internally use only.
+ */
+static void *_ctap_stress_main(void *arg)
+{
+    struct ctap_stress_thread *self = arg;
+    unsigned long i;
+    double start;
+
+    stress_self = self;
+
+    /* Spin barrier to release all threads at once */
+    __atomic_add_fetch(self->arrived, 1, __ATOMIC_ACQ_REL);
+    while (!__atomic_load_n(self->go, __ATOMIC_ACQUIRE)) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    start = _ctap_now_ns();
+    for (i = 0; i < self->iterations; i++)
+        self->fn(self->ctx, self->id);
+    self->elapsed = _ctap_now_ns() - start;
+
+    stress_self = NULL;
+    return NULL;
+}
+
+int _stress(const char *name, void (*func)(void *, uint), void *ctx,
+            uint nthreads, unsigned long iterations, const char *file, uint line)
+{
+    struct ctap_stress_thread *threads;
+    volatile uint arrived = 0;
+    volatile int go = 0;
+    pthread_attr_t attr;
+    cpu_set_t allowed, cpus;
+    uint i, fail = 0;
+    int cpu, ncpu, err;
+    double start, elapsed, min, max;
+    const char *p, *q;
+    uint result;
+
+    if ((threads = calloc(nthreads, sizeof(*threads))) == NULL)
+        bail("Failed to allocate memory for stress threads: ");
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        CPU_ZERO(&allowed);
+    ncpu = CPU_COUNT(&allowed);
+
+    for (i = 0, cpu = -1; i < nthreads; i++) {
+        threads[i].id         = i;
+        threads[i].fn         = func;
+        threads[i].ctx        = ctx;
+        threads[i].iterations = iterations;
+        threads[i].arrived    = &arrived;
+        threads[i].go         = &go;
+
+        pthread_attr_init(&attr);
+        if (ncpu > 0) {
+            /* Round robin over allowed CPUs */
+            do {
+                cpu = (cpu + 1) % CPU_SETSIZE;
+            } while (!CPU_ISSET(cpu, &allowed));
+            CPU_ZERO(&cpus);
+            CPU_SET(cpu, &cpus);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+        if ((err = pthread_create(&threads[i].thread, &attr, _ctap_stress_main, &threads[i])) != 0)
+            bail("Failed to create stress thread: %s\n", strerror(err));
+        pthread_attr_destroy(&attr);
+    }
+
+    while (__atomic_load_n(&arrived, __ATOMIC_ACQUIRE) < nthreads)
+        sched_yield();
+    start = _ctap_now_ns();
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i].thread, NULL);
+    elapsed = _ctap_now_ns() - start;
+
+    min = max = nthreads ? threads[0].elapsed : 0;
+    for (i = 0; i < nthreads; i++) {
+        fail += threads[i].fail;
+        if (threads[i].elapsed < min) min = threads[i].elapsed;
+        if (threads[i].elapsed > max) max = threads[i].elapsed;
+    }
+
+    result = _ok((fail == 0), COND_TRUE, file, line, "%s", name);
+    GOT("throughput", "%.0f ops/s (%u threads x %lu iterations in %.3f ms)",
+        nthreads * (double)iterations / (elapsed / 1e9), nthreads, iterations, elapsed / 1e6);
+    GOT(" imbalance", "%.1f%% (fastest %.3f ms, slowest %.3f ms)",
+        (max > 0) ? (max - min) / max * 100 : 0.0, min / 1e6, max / 1e6);
+    for (i = 0; i < nthreads; i++) {
+        if (threads[i].fail == 0)
+            continue;
+        diag("    thread %u: %u of %u assertions failed, first \"%s\" at %s line %u\n",
+             i, threads[i].fail, threads[i].run,
+             threads[i].fail_name, threads[i].fail_file, threads[i].fail_line);
+        for (p = threads[i].fail_diag; *p; p = q + (*q != '\0')) {
+            q = strchrnul(p, '\n');
+            diag("    %.*s\n", (int)(q - p), p);
+        }
+    }
+
+    free(threads);
+    return result;
+}
+
+/**
+ * Allocate a memory space from the arena of the running subtest. This function is internally use only.
+ * Chunks are mapped with mmap(2), and if CTAP_ARENA_HUGEPAGES=1, aligned by the huge page size
+ * and advised to be backed by transparent huge pages.
+ *
+ * @param size  a size of memory space.
+ * @param align an alignment of memory space, must be a power of 2.
+ */
+static void *_ctap_arena_alloc(size_t size, size_t align)
+{
+    struct ctap_arena_chunk *chunk = arenas[current];
+    size_t off, need, head;
+    char *map;
+
+    if (chunk) {
+        /* Align the address, the chunk itself is aligned by the page size only */
+        off = (((uintptr_t)chunk + chunk->used + align - 1) & ~(uintptr_t)(align - 1)) - (uintptr_t)chunk;
+        if (off <= chunk->size && size <= chunk->size - off) {
+            chunk->used = off + size;
+            return (char *)chunk + off;
+        }
+    }
+
+    need = sizeof(*chunk) + align + size;
+    if (need < size)
+        bail("Too large allocation for ctap_alloc(): %zu bytes\n", size);
+    need = (need + CTAP_ARENA_CHUNK - 1) / CTAP_ARENA_CHUNK * CTAP_ARENA_CHUNK;
+
+    if (arena_hugepages) {
+        /* Huge pages only back ranges aligned by their size, so map more and trim it to the boundary */
+        map = mmap(NULL, need + CTAP_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+            bail("Failed to allocate %zu bytes for ctap_alloc(): %s\n", need, strerror(errno));
+        chunk = (void *)(((uintptr_t)map + CTAP_HUGEPAGE_SIZE - 1) & ~(uintptr_t)(CTAP_HUGEPAGE_SIZE - 1));
+        head  = (char *)chunk - map;
+        if (head)
+            munmap(map, head);
+        munmap((char *)chunk + need, CTAP_HUGEPAGE_SIZE - head);
+#ifdef MADV_HUGEPAGE
+        madvise(chunk, need, MADV_HUGEPAGE);
+#endif
+    } else {
+        chunk = mmap(NULL, need, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED)
+            bail("Failed to allocate %zu bytes for ctap_alloc(): %s\n", need, strerror(errno));
+    }
+
+    chunk->next = arenas[current];
+    chunk->size = need;
+    chunk->used = sizeof(*chunk);
+    arenas[current] = chunk;
+
+    return _ctap_arena_alloc(size, align);
+}
+
+/**
+ * Release all memory allocated by ctap_alloc() in the subtest at the given depth.
+ * One chunk of the default size is kept for reuse, so the memory stays bounded
+ * no matter how many subtests ran. This function is internally use only.
+ */
+static void _ctap_arena_release(uint depth)
+{
+    struct ctap_arena_chunk *chunk = arenas[depth], *next, *spare = NULL;
+
+    for (; chunk; chunk = next) {
+        next = chunk->next;
+        if (spare == NULL && chunk->size == CTAP_ARENA_CHUNK) {
+            spare = chunk;
+            continue;
+        }
+        munmap(chunk, chunk->size);
+    }
+
+    if (spare) {
+        spare->next = NULL;
+        spare->used = sizeof(*spare);
+    }
+    arenas[depth] = spare;
+}
+
+void *ctap_alloc(size_t size)
+{
+    return _ctap_arena_alloc(size, CTAP_ARENA_ALIGN);
+}
+
+void *ctap_calloc_aligned(size_t nmemb, size_t size, size_t align)
+{
+    void *p;
+
+    if (size && nmemb > (size_t)-1 / size)
+        bail("Too large allocation for ctap_calloc_aligned(): %zu * %zu bytes\n", nmemb, size);
+    if (align < CTAP_ARENA_ALIGN)
+        align = CTAP_ARENA_ALIGN;
+    assert((align & (align - 1)) == 0);
+
+    p = _ctap_arena_alloc(nmemb * size, align);
+    memset(p, 0, nmemb * size);
+    return p;
+}
+
+/**
+ * Allocate a guarded buffer. This function is internally use only.
+ *
+ * @param under non-zero to place the buffer at the beginning of data pages.
+ */
+static void *_ctap_guarded_alloc(size_t size, size_t align, int under)
+{
+    size_t page = sysconf(_SC_PAGESIZE), npages;
+    struct ctap_guarded *g, **pp;
+
+    if (align == 0)
+        align = 1;
+    assert((align & (align - 1)) == 0 && align <= page);
+    npages = (size + page - 1) / page;
+    if (npages == 0)
+        npages = 1;
+
+    /* Reuse a pooled mapping of the same size to avoid mmap(2) and mprotect(2) */
+    for (pp = &guarded_pool; *pp; pp = &(*pp)->next) {
+        if ((*pp)->npages == npages)
+            break;
+    }
+    if ((g = *pp) != NULL) {
+        *pp = g->next;
+        guarded_npool--;
+    } else {
+        if ((g = malloc(sizeof(*g))) == NULL)
+            bail("Failed to allocate memory for ctap_guarded_alloc(): ");
+        g->npages = npages;
+        g->map = mmap(NULL, (npages + 2) * page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (g->map == MAP_FAILED)
+            bail("Failed to allocate %zu bytes for ctap_guarded_alloc(): %s\n", size, strerror(errno));
+        if (mprotect(g->map + page, npages * page, PROT_READ | PROT_WRITE) < 0)
+            bail("Failed to mprotect for ctap_guarded_alloc(): %s\n", strerror(errno));
+    }
+
+    if (under)
+        g->ptr = g->map + page;
+    else
+        g->ptr = (char *)((uintptr_t)(g->map + (npages + 1) * page - size) & ~(uintptr_t)(align - 1));
+    g->size = size;
+
+    g->next = guarded_live;
+    guarded_live = g;
+    return g->ptr;
+}
+
+void *ctap_guarded_alloc(size_t size, size_t align)
+{
+    return _ctap_guarded_alloc(size, align, 0);
+}
+
+void *ctap_guarded_alloc_under(size_t size, size_t align)
+{
+    return _ctap_guarded_alloc(size, align, 1);
+}
+
+void ctap_guarded_free(void *ptr)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct ctap_guarded *g, **pp;
+
+    if (ptr == NULL)
+        return;
+    for (pp = &guarded_live; *pp; pp = &(*pp)->next) {
+        if ((*pp)->ptr == ptr)
+            break;
+    }
+    if ((g = *pp) == NULL)
+        bail("ctap_guarded_free(): %p is not allocated by ctap_guarded_alloc()\n", ptr);
+    *pp = g->next;
+
+    if (guarded_npool < CTAP_GUARD_POOL_MAX) {
+        g->next = guarded_pool;
+        guarded_pool = g;
+        guarded_npool++;
+    } else {
+        munmap(g->map, (g->npages + 2) * page);
+        free(g);
+    }
+}
+
+/**
+ * Find the guarded buffer whose guard page contains the address. This function is internally use only.
+ */
+static struct ctap_guarded *_ctap_guarded_find(const void *addr)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct ctap_guarded *g;
+    const char *p = addr;
+
+    for (g = guarded_live; g; g = g->next) {
+        if ((p >= g->map && p < g->map + page) ||
+            (p >= g->map + (g->npages + 1) * page && p < g->map + (g->npages + 2) * page))
+            return g;
+    }
+    return NULL;
+}
+
+
+/**
+ * Report a crash of the running subtest. This function is internally use only.
+ */
+static void _ctap_report_crash(int sig, const char *file, uint line)
+{
+    struct ctap_guarded *g;
+    char **symbols;
+    int i;
+
+    _fail(file, line, "Caught %s", _ctap_signame(sig));
+
+    if ((sig == SIGSEGV || sig == SIGBUS) && (g = _ctap_guarded_find(crash_addr)) != NULL) {
+        pindent(msgout);
+        diag("    %s of guarded buffer %p (size %zu) at offset %td\n",
+             ((char *)crash_addr < g->ptr) ? "underflow" : "overflow",
+             g->ptr, g->size, (char *)crash_addr - g->ptr);
+    }
+
+    if ((symbols = backtrace_symbols(crash_trace, crash_trace_size)) == NULL)
+        return;
+    pindent(msgout);
+    diag("    backtrace:\n");
+    for (i = 0; i < crash_trace_size; i++) {
+        pindent(msgout);
+        diag("      %s\n", symbols[i]);
+    }
+    free(symbols);
+}
+
+int _subtest(const char *name, void (*func)(void),
+              const char *file, uint line)
+{
+    uint subtestp;
+    int sig;
+
+    if (repeat_env > 1 && !repeating)
+        return _subtest_repeat(name, func, repeat_env, file, line);
+
+    // Push tests status stack
+    if (++current == SUBTEST_MAX_DEPTH) {
+        bail("Too deep subtest nesting. You can change macro SUBTEST_MAX_DEPTH to change this value.");
+    }
+
+    plan(-1);
+    _ctap_status_enter(name);
+    subtestp = current;
+    subtest_thread = pthread_self();
+    if (catch_signals && (sig = sigsetjmp(subtest_jmp[subtestp], 1)) != 0) {
+        // Crashed: unwind subtests nested in this one
+        current = subtestp;
+        _ctap_report_crash(sig, file, line);
+    } else {
+        func();
+    }
+    
+    done_testing(-1);
+    _ctap_arena_release(subtestp);
+
+    // Pop tests status stack
+    subtestp = current--;
+    _ctap_status_enter(NULL);
+
+    assert(current >= 0);
+
+    uint sub_result;
+    if (tests[subtestp].run == 0) {
+        sub_result = _fail(file, line, "No tests run for subtest \"%s\"", name);
+    } else {
+        sub_result = _ok((tests[subtestp].run == tests[subtestp].pass), COND_TRUE, file, line, "%s", name);
+    }
+    return sub_result;
+}
+
+/* Arguments of subtest_repeat() passed to its outer subtest */
+static void      (*repeat_func)(void);
+static const char *repeat_name;
+static uint        repeat_count;
+static const char *repeat_file;
+static uint        repeat_line;
+
+/**
+ * Body of the outer subtest of subtest_repeat(). This function is internally use only.
+ */
+static void _ctap_repeat(void)
+{
+    void (*func)(void) = repeat_func;
+    const char *name   = repeat_name;
+    uint count         = repeat_count;
+    const char *file   = repeat_file;
+    uint line          = repeat_line;
+    char iter[32];
+    double start, t, delta;
+    uint i, r = 0, result;
+
+    for (r = 0; r < nrepeats && strcmp(repeats[r].name, name); r++)
+        ;
+    if (r == nrepeats && nrepeats < CTAP_REPEAT_MAX)
+        repeats[nrepeats++].name = name;
+
+    for (i = 1; i <= count; i++) {
+        snprintf(iter, sizeof(iter), "run %u/%u", i, count);
+        start  = _ctap_now_ns();
+        result = _subtest(iter, func, file, line);
+        t      = _ctap_now_ns() - start;
+
+        if (r == CTAP_REPEAT_MAX)
+            continue;
+        /* Welford's online variance */
+        repeats[r].runs++;
+        repeats[r].pass += !!result;
+        delta            = t - repeats[r].mean;
+        repeats[r].mean += delta / repeats[r].runs;
+        repeats[r].m2   += delta * (t - repeats[r].mean);
+    }
+}
+
+int _subtest_repeat(const char *name, void (*func)(void), uint count,
+                    const char *file, uint line)
+{
+    int saved = repeating, result;
+
+    repeat_func  = func;
+    repeat_name  = name;
+    repeat_count = count;
+    repeat_file  = file;
+    repeat_line  = line;
+
+    repeating = 1;
+    result = _subtest(name, _ctap_repeat, file, line);
+    repeating = saved;
+
+    return result;
+}
+
+const char *const ctap_isa_names[CTAP_ISA_MAX] = { "scalar", "sse4.2", "avx2", "avx512" };
+
+static int _ctap_isa_supported(enum ctap_isa isa)
+{
+    switch (isa) {
+    case CTAP_ISA_SCALAR: return 1;
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    case CTAP_ISA_SSE42:  return __builtin_cpu_supports("sse4.2");
+    case CTAP_ISA_AVX2:   return __builtin_cpu_supports("avx2");
+    case CTAP_ISA_AVX512: return __builtin_cpu_supports("avx512f");
+#endif
+    default:              return 0;
+    }
+}
+
+/* Arguments of subtest_each_isa() passed to its outer subtest */
+static void      (*each_isa_func)(void);
+static const char *each_isa_file;
+static uint        each_isa_line;
+
+/**
+ * Body of the outer subtest of subtest_each_isa(). This function is internally use only.
+ */
+static void _ctap_each_isa(void)
+{
+    void (*func)(void) = each_isa_func;
+    const char *file   = each_isa_file;
+    uint line          = each_isa_line;
+    enum ctap_isa saved = ctap_forced_isa, isa;
+    double start;
+
+    for (isa = CTAP_ISA_SCALAR; isa < CTAP_ISA_MAX; isa++) {
+        if (!_ctap_isa_supported(isa)) {
+            _ctap_skip("%s is not supported by this CPU", ctap_isa_names[isa]);
+            continue;
+        }
+        ctap_forced_isa = isa;
+        start = _ctap_now_ns();
+        _subtest(ctap_isa_names[isa], func, file, line);
+        GOT("    time", "%.3f ms", (_ctap_now_ns() - start) / 1e6);
+    }
+
+    ctap_forced_isa = saved;
+
+    /* Nested subtest_each_isa() may overwrite them, restore for the next run under CTAP_REPEAT */
+    each_isa_func = func;
+    each_isa_file = file;
+    each_isa_line = line;
+}
+
+int _subtest_each_isa(const char *name, void (*func)(void),
+                      const char *file, uint line)
+{
+    each_isa_func = func;
+    each_isa_file = file;
+    each_isa_line = line;
+
+    return _subtest(name, _ctap_each_isa, file, line);
+}
+
+/* A child process of subtest_exec() */
+struct ctap_child {
+    pid_t  pid;
+    int    fds[2];     /* stdout and stderr pipes, -1 if inherited or closed */
+    int    resfd;      /* read end of CTAP_RESULT_FD */
+    char  *buf[2];     /* output buffered while another child is reported */
+    size_t len[2];
+    size_t cap[2];
+    int    status;
+    int    done;
+};
+
+/**
+ * Start a ctap test program as a child. This function is internally use only.
+ * The child indents its TAP by itself according to CTAP_INDENT, and writes its result to CTAP_RESULT_FD.
+ *
+ * @param capture non-zero to pipe stdout and stderr of the child, otherwise they are inherited.
+ */
+static void _ctap_child_spawn(struct ctap_child *child, char *const argv[], int capture)
+{
+    int res[2], out[2] = { -1, -1 }, err[2] = { -1, -1 };
+    char buf[16];
+
+    memset(child, 0, sizeof(*child));
+    child->fds[0] = child->fds[1] = -1;
+
+    if (pipe2(res, O_CLOEXEC) < 0 ||
+        (capture && (pipe2(out, O_CLOEXEC) < 0 || pipe2(err, O_CLOEXEC) < 0)))
+        bail("Failed to create pipe for subtest_exec(): %s\n", strerror(errno));
+
+    if ((child->pid = fork()) < 0)
+        bail("Failed to fork for subtest_exec(): %s\n", strerror(errno));
+
+    if (child->pid == 0) {
+        if (capture) {
+            dup2(out[1], STDOUT_FILENO);
+            dup2(err[1], STDERR_FILENO);
+        }
+        fcntl(res[1], F_SETFD, 0);
+        snprintf(buf, sizeof(buf), "%u", indent_base + current + 1);
+        setenv("CTAP_INDENT", buf, 1);
+        snprintf(buf, sizeof(buf), "%d", res[1]);
+        setenv("CTAP_RESULT_FD", buf, 1);
+        unsetenv("CTAP_STATUS_FILE");
+        execvp(argv[0], argv);
+        dprintf(STDERR_FILENO, "Failed to exec %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+
+    close(res[1]);
+    child->resfd = res[0];
+    if (capture) {
+        close(out[1]);
+        close(err[1]);
+        child->fds[0] = out[0];
+        child->fds[1] = err[0];
+    }
+}
+
+/**
+ * Report the result of a finished child as a single test. This function is internally use only.
+ */
+static int _ctap_child_report(struct ctap_child *child, const char *name,
+                              const char *file, uint line)
+{
+    char buf[128];
+    ssize_t n;
+    int plan = 0, got = 0;
+    uint run = 0, pass = 0, fail = 0, result;
+
+    while ((n = read(child->resfd, buf, sizeof(buf) - 1)) < 0 && errno == EINTR)
+        ;
+    close(child->resfd);
+    if (n > 0) {
+        buf[n] = '\0';
+        got = (sscanf(buf, "%d %u %u %u", &plan, &run, &pass, &fail) == 4);
+    }
+
+    result = _ok((got && run > 0 && run == pass && (uint)plan == run &&
+                  WIFEXITED(child->status) && WEXITSTATUS(child->status) == 0),
+                 COND_TRUE, file, line, "%s", name);
+    if (!result) {
+        if (WIFSIGNALED(child->status))
+            GOT("  status", "killed by signal %d", WTERMSIG(child->status));
+        else
+            GOT("  status", "exited with %d", WEXITSTATUS(child->status));
+        if (!got)
+            GOT("  result", "not reported, not a ctap test or died before done_testing()");
+        else if (run == 0)
+            GOT("  result", "no tests run");
+    }
+    return result;
+}
+
+int _subtest_exec(const char *name, char *const argv[], const char *file, uint line)
+{
+    struct ctap_child child;
+
+    _ctap_child_spawn(&child, argv, 0);
+    while (waitpid(child.pid, &child.status, 0) < 0 && errno == EINTR)
+        ;
+
+    return _ctap_child_report(&child, name, file, line);
+}
+
+/**
+ * Append output of a child to its buffer, or write it out if the child is being reported.
+ * This function is internally use only.
+ */
+static void _ctap_child_output(struct ctap_child *child, int i, const char *data, size_t len, int head)
+{
+    FILE *out = i ? msgout : tapout;
+
+    if (head) {
+        fwrite(data, 1, len, out);
+        return;
+    }
+    if (child->len[i] + len > child->cap[i]) {
+        child->cap[i] = (child->len[i] + len) * 2;
+        if ((child->buf[i] = realloc(child->buf[i], child->cap[i])) == NULL)
+            bail("Failed to allocate memory for subtest_exec_many(): ");
+    }
+    memcpy(child->buf[i] + child->len[i], data, len);
+    child->len[i] += len;
+}
+
+int _subtest_exec_many(char *const *const argvs[], uint count, uint jobs,
+                       const char *file, uint line)
+{
+    struct ctap_child *children;
+    struct pollfd *pfds;
+    uint *owner;
+    uint head = 0, next = 0, running = 0, npfd, i, passed = 0;
+    char buf[65536];
+    ssize_t n;
+    int k;
+
+    if (jobs == 0)
+        jobs = 1;
+    if ((children = calloc(count, sizeof(*children))) == NULL ||
+        (pfds = calloc(jobs * 2, sizeof(*pfds))) == NULL ||
+        (owner = calloc(jobs * 2, sizeof(*owner))) == NULL)
+        bail("Failed to allocate memory for subtest_exec_many(): ");
+
+    while (head < count) {
+        while (next < count && running < jobs) {
+            _ctap_child_spawn(&children[next], argvs[next], 1);
+            next++;
+            running++;
+        }
+
+        npfd = 0;
+        for (i = head; i < next; i++) {
+            for (k = 0; k < 2; k++) {
+                if (children[i].fds[k] < 0)
+                    continue;
+                pfds[npfd].fd     = children[i].fds[k];
+                pfds[npfd].events = POLLIN;
+                owner[npfd++]     = i * 2 + k;
+            }
+        }
+
+        if (npfd && poll(pfds, npfd, -1) < 0 && errno != EINTR)
+            bail("Failed to poll for subtest_exec_many(): %s\n", strerror(errno));
+
+        for (i = 0; i < npfd; i++) {
+            struct ctap_child *child = &children[owner[i] / 2];
+            k = owner[i] % 2;
+            if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            if ((n = read(child->fds[k], buf, sizeof(buf))) > 0) {
+                _ctap_child_output(child, k, buf, n, (owner[i] / 2 == head));
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            close(child->fds[k]);
+            child->fds[k] = -1;
+            if (child->fds[0] < 0 && child->fds[1] < 0) {
+                while (waitpid(child->pid, &child->status, 0) < 0 && errno == EINTR)
+                    ;
+                child->done = 1;
+                running--;
+            }
+        }
+
+        /* Report finished children in order, then let the next one write straight through */
+        while (head < next && children[head].done) {
+            passed += _ctap_child_report(&children[head], argvs[head][0], file, line);
+            free(children[head].buf[0]);
+            free(children[head].buf[1]);
+            if (++head < next) {
+                for (k = 0; k < 2; k++) {
+                    _ctap_child_output(&children[head], k, children[head].buf[k], children[head].len[k], 1);
+                    children[head].len[k] = 0;
+                }
+            }
+        }
+    }
+
+    free(owner);
+    free(pfds);
+    free(children);
+    return passed;
+}
+
+#endif /* CTAP_IMPLEMENTATION */